@@ -2,6 +2,10 @@
 #include <stdlib.h>
 #include <stdarg.h>
 #include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
 #include "btree.h"
 
 int maxHeight;
@@ -16,9 +20,24 @@ int bErrLineNo;
 
 static hNode hList;
 static hNode *h;
+static poolType *pool;
 
 #define error(rc) lineError(__LINE__, rc)
 
+#define MAX_HEIGHT 32
+#define FILTER_BLOCK 64
+#define FILTER_PROBES 6
+#define SCAN_AHEAD 32
+#define POOL_MIN 8
+#define POOL_PROTECT 32
+#define POOL_HITS 8
+#define FREE_MARK -1
+#define ERR_PENDING ((bErrType)-1)
+
+#define swizzled(adr) ((adr) & 1)
+#define unswizzle(adr) ((bufType *)((adr) - 1))
+#define bref(b) ((b)->pinned ? (bAdrType)(b) + 1 : (b)->adr)
+
 static bErrType lineError(int lineno, bErrType rc) {
     if (rc == bErrIO || rc == bErrMemory)
         if (!bErrLineNo)
@@ -26,20 +45,37 @@ static bErrType lineError(int lineno, bErrType rc) {
     return rc;
 }
 
-static bAdrType allocAdr(void) {
+static bAdrType appendAdr(void) {
     bAdrType adr;
     adr = h->nextFreeAdr;
     h->nextFreeAdr += h->sectorSize;
     return adr;
 }
 
+static nodeType *unswizzleNode(bufType *buf, int len) {
+    bufType *tbuf;
+    bAdrType *c;
+    int i;
+
+    tbuf = h->pinList;
+    memcpy(tbuf->p, buf->p, len);
+    for (i = 0; i <= ct(tbuf); i++) {
+        c = i ? &childGE(fkey(tbuf) + ks(i - 1)) : &childLT(fkey(tbuf));
+        if (swizzled(*c)) *c = unswizzle(*c)->adr;
+    }
+    return tbuf->p;
+}
+
 static bErrType flush(bufType *buf) {
     int len;
+    nodeType *p;
 
     len = h->sectorSize;
     if (buf->adr == 0) len *= 3;
+    p = buf->p;
+    if (h->pinList && !leaf(buf)) p = unswizzleNode(buf, len);
     if (fseek(h->fp, buf->adr, SEEK_SET)) return error(bErrIO);
-    if (fwrite(buf->p, len, 1, h->fp) != 1) return error(bErrIO);
+    if (fwrite(p, len, 1, h->fp) != 1) return error(bErrIO);
     buf->modified = false;
     nDiskWrites++;
     return bErrOk;
@@ -48,6 +84,7 @@ static bErrType flush(bufType *buf) {
 static bErrType flushAll(void) {
     bErrType rc;
     bufType *buf;
+    long i;
 
     if (h->root.modified)
         if ((rc = flush(&h->root)) != 0) return rc;
@@ -58,6 +95,261 @@ static bErrType flushAll(void) {
             if ((rc = flush(buf)) != 0) return rc;
         buf = buf->next;
     }
+
+    if (h->pooled) {
+        for (i = 0; i < pool->nFrames; i++) {
+            buf = pool->frame[i];
+            if (buf->owner == h && buf->modified)
+                if ((rc = flush(buf)) != 0) return rc;
+        }
+    }
+
+    if (h->pinList) {
+        buf = h->pinList->next;
+        while (buf != h->pinList) {
+            if (buf->modified)
+                if ((rc = flush(buf)) != 0) return rc;
+            buf = buf->next;
+        }
+    }
+    return bErrOk;
+}
+
+static bErrType pinAlloc(bAdrType adr, bufType **b) {
+    bufType *buf;
+
+    if ((buf = malloc(sizeof(bufType) + h->sectorSize)) == NULL)
+        return error(bErrMemory);
+    buf->adr = adr;
+    buf->p = (nodeType *)(buf + 1);
+    buf->valid = false;
+    buf->modified = false;
+    buf->pinned = true;
+    buf->owner = h;
+    buf->next = h->pinList->next;
+    buf->prev = h->pinList;
+    buf->next->prev = buf;
+    buf->prev->next = buf;
+    *b = buf;
+    return bErrOk;
+}
+
+static bErrType pinNew(bAdrType adr, bufType **b) {
+    bErrType rc;
+
+    if ((rc = pinAlloc(adr, b)) != 0) return rc;
+    memset((*b)->p, 0, h->sectorSize);
+    return flush(*b);
+}
+
+static void unpin(bufType *buf) {
+    buf->next->prev = buf->prev;
+    buf->prev->next = buf->next;
+    free(buf);
+}
+
+static long poolSlot(hNode *owner, bAdrType adr) {
+    unsigned long hv;
+
+    hv = (unsigned long)owner ^ ((unsigned long)adr * 0x9e3779b97f4a7c15UL);
+    return (hv >> 17) & (pool->nHash - 1);
+}
+
+static void poolUnhash(bufType *buf) {
+    bufType **pp;
+
+    for (pp = &pool->hash[poolSlot(buf->owner, buf->adr)]; *pp; pp = &(*pp)->hnext) {
+        if (*pp == buf) {
+            *pp = buf->hnext;
+            break;
+        }
+    }
+    buf->owner->poolFrames--;
+    buf->owner = NULL;
+    buf->valid = false;
+    buf->modified = false;
+}
+
+static bErrType poolNewFrame(bufType **b) {
+    bufType *buf;
+    bufType **frame;
+    bufType **hash;
+    long i;
+
+    if (pool->nFrames == pool->maxFrames) {
+        if ((frame = realloc(pool->frame, 2 * pool->maxFrames * sizeof(bufType *))) == NULL)
+            return error(bErrMemory);
+        pool->frame = frame;
+        pool->maxFrames *= 2;
+    }
+    if (pool->nFrames == pool->nHash) {
+        if ((hash = calloc(2 * pool->nHash, sizeof(bufType *))) == NULL)
+            return error(bErrMemory);
+        free(pool->hash);
+        pool->hash = hash;
+        pool->nHash *= 2;
+        for (i = 0; i < pool->nFrames; i++) {
+            buf = pool->frame[i];
+            if (buf->owner) {
+                buf->hnext = hash[poolSlot(buf->owner, buf->adr)];
+                hash[poolSlot(buf->owner, buf->adr)] = buf;
+            }
+        }
+    }
+    if ((buf = malloc(sizeof(bufType) + h->sectorSize)) == NULL)
+        return error(bErrMemory);
+    memset(buf, 0, sizeof(bufType));
+    buf->p = (nodeType *)(buf + 1);
+    buf->size = h->sectorSize;
+    pool->frame[pool->nFrames++] = buf;
+    pool->bytes += sizeof(bufType) + h->sectorSize;
+    *b = buf;
+    return bErrOk;
+}
+
+static bool poolCursor(bufType *buf) {
+    hNode *th;
+
+    for (th = hList.next; th && th != &hList; th = th->next)
+        if (th->curBuf == buf) return true;
+    return false;
+}
+
+static void poolDrop(long i) {
+    bufType *buf;
+
+    buf = pool->frame[i];
+    pool->bytes -= sizeof(bufType) + buf->size;
+    free(buf);
+    pool->frame[i] = pool->frame[--pool->nFrames];
+    pool->hand = pool->nFrames ? i % pool->nFrames : 0;
+}
+
+static bErrType poolVictim(bufType **b) {
+    bErrType rc;
+    bufType *buf;
+    hNode *owner;
+    long need;
+    long n;
+    long i;
+    int pass;
+
+    need = sizeof(bufType) + h->sectorSize;
+    if (pool->bytes + need <= pool->maxBytes)
+        return poolNewFrame(b);
+
+    for (pass = 0; pass < 2; pass++) {
+        for (n = (POOL_HITS + 1) * pool->nFrames; n > 0 && pool->nFrames; n--) {
+            i = pool->hand;
+            buf = pool->frame[i];
+            pool->hand = (i + 1) % pool->nFrames;
+            if (buf->owner) {
+                if (pool->tick - buf->used < POOL_PROTECT) continue;
+                if (pass == 0 && buf->owner != h && buf->owner->poolFrames <= POOL_MIN) continue;
+                if (pass == 0 && buf->hits) {
+                    buf->hits--;
+                    continue;
+                }
+                if (buf->modified) {
+                    owner = h;
+                    h = buf->owner;
+                    rc = flush(buf);
+                    h = owner;
+                    if (rc != 0) return rc;
+                }
+                poolUnhash(buf);
+            }
+            if (buf->size == h->sectorSize) {
+                *b = buf;
+                return bErrOk;
+            }
+            if (poolCursor(buf)) continue;
+            poolDrop(i);
+            if (pool->bytes + need <= pool->maxBytes)
+                return poolNewFrame(b);
+        }
+    }
+    return poolNewFrame(b);
+}
+
+static bErrType poolAssign(bAdrType adr, bufType **b) {
+    bErrType rc;
+    bufType *buf;
+    long i;
+
+    for (buf = pool->hash[poolSlot(h, adr)]; buf; buf = buf->hnext)
+        if (buf->owner == h && buf->adr == adr) break;
+
+    if (buf == NULL) {
+        if ((rc = poolVictim(&buf)) != 0) return rc;
+        i = poolSlot(h, adr);
+        buf->owner = h;
+        buf->adr = adr;
+        buf->valid = false;
+        buf->modified = false;
+        buf->hits = 0;
+        buf->hnext = pool->hash[i];
+        pool->hash[i] = buf;
+        h->poolFrames++;
+    } else if (buf->hits < POOL_HITS) {
+        buf->hits++;
+    }
+    buf->used = ++pool->tick;
+    *b = buf;
+    return bErrOk;
+}
+
+static void poolRelease(void) {
+    long i;
+
+    for (i = 0; i < pool->nFrames; i++)
+        if (pool->frame[i]->owner == h)
+            poolUnhash(pool->frame[i]);
+}
+
+bErrType bPoolInit(long maxBytes) {
+    if (pool) return bErrPoolInUse;
+    if ((pool = malloc(sizeof(poolType))) == NULL) return error(bErrMemory);
+    memset(pool, 0, sizeof(poolType));
+    pool->maxBytes = maxBytes;
+    pool->maxFrames = 64;
+    pool->nHash = 64;
+    if ((pool->frame = malloc(pool->maxFrames * sizeof(bufType *))) == NULL
+        || (pool->hash = calloc(pool->nHash, sizeof(bufType *))) == NULL) {
+        free(pool->frame);
+        free(pool);
+        pool = NULL;
+        return error(bErrMemory);
+    }
+    return bErrOk;
+}
+
+bErrType bPoolFree(void) {
+    long i;
+
+    if (pool == NULL) return bErrOk;
+    if (pool->nHandles) return bErrPoolInUse;
+    for (i = 0; i < pool->nFrames; i++)
+        free(pool->frame[i]);
+    free(pool->frame);
+    free(pool->hash);
+    free(pool);
+    pool = NULL;
+    return bErrOk;
+}
+
+bErrType bPoolStat(bHandleType handle, long *frames, long *bytes) {
+    hNode *th;
+
+    if (pool == NULL) return bErrFileNotOpen;
+    if (handle == NULL) {
+        *frames = pool->nFrames;
+        *bytes = pool->bytes;
+        return bErrOk;
+    }
+    th = handle;
+    *frames = th->poolFrames;
+    *bytes = th->poolFrames * (long)(sizeof(bufType) + th->sectorSize);
     return bErrOk;
 }
 
@@ -69,6 +361,11 @@ static bErrType assignBuf(bAdrType adr, bufType **b) {
         *b = &h->root;
         return bErrOk;
     }
+    if (swizzled(adr)) {
+        *b = unswizzle(adr);
+        return bErrOk;
+    }
+    if (h->pooled) return poolAssign(adr, b);
 
     buf = h->bufList.next;
     while (buf->next != &h->bufList) {
@@ -98,9 +395,34 @@ static bErrType assignBuf(bAdrType adr, bufType **b) {
     return bErrOk;
 }
 
+static bAdrType newStamp(bAdrType old) {
+    unsigned long s;
+
+    s = (unsigned long)old ^ (unsigned long)time(NULL) ^ ((unsigned long)getpid() << 32)
+        ^ (unsigned long)h;
+    s *= 0x9e3779b97f4a7c15UL;
+    return (bAdrType)(s ^ (s >> 29));
+}
+
+static bErrType stampRoot(void) {
+    bufType *root;
+
+    root = &h->root;
+    h->stamped = true;
+    modStamp(root) = newStamp(modStamp(root));
+    root->modified = true;
+    if (fseek(h->fp, 3 * h->sectorSize - 2 * sizeof(bAdrType), SEEK_SET))
+        return error(bErrIO);
+    if (fwrite(&modStamp(root), sizeof(bAdrType), 1, h->fp) != 1)
+        return error(bErrIO);
+    return bErrOk;
+}
+
 static bErrType writeDisk(bufType *buf) {
     buf->valid = true;
     buf->modified = true;
+    h->writeSeq++;
+    if (!h->stamped) return stampRoot();
     return bErrOk;
 }
 
@@ -111,6 +433,10 @@ static bErrType readDisk(bAdrType adr, bufType **b) {
 
     if ((rc = assignBuf(adr, &buf)) != 0) return rc;
     if (!buf->valid) {
+        if (h->noWait) {
+            h->missAdr = adr;
+            return ERR_PENDING;
+        }
         len = h->sectorSize;
         if (adr == 0) len *= 3;
         if (fseek(h->fp, adr, SEEK_SET)) return error(bErrIO);
@@ -123,6 +449,321 @@ static bErrType readDisk(bAdrType adr, bufType **b) {
     return bErrOk;
 }
 
+static bErrType allocAdr(bAdrType *adr) {
+    bErrType rc;
+    bufType *buf;
+    bufType *root;
+
+    root = &h->root;
+    if ((*adr = freeHead(root)) == 0) {
+        *adr = appendAdr();
+        return bErrOk;
+    }
+    if ((rc = readDisk(*adr, &buf)) != 0) return rc;
+    freeHead(root) = next(buf);
+    buf->valid = false;
+    buf->modified = false;
+    return writeDisk(root);
+}
+
+static bErrType freePage(bAdrType adr) {
+    bErrType rc;
+    bufType *buf;
+    bufType *root;
+
+    root = &h->root;
+    if (freeHead(root)) {
+        if ((rc = readDisk(freeHead(root), &buf)) != 0) return rc;
+        prev(buf) = adr;
+        if ((rc = writeDisk(buf)) != 0) return rc;
+    }
+    if ((rc = assignBuf(adr, &buf)) != 0) return rc;
+    leaf(buf) = 1;
+    ct(buf) = 0;
+    childLT(fkey(buf)) = FREE_MARK;
+    prev(buf) = 0;
+    next(buf) = freeHead(root);
+    freeHead(root) = adr;
+    if ((rc = writeDisk(buf)) != 0) return rc;
+    return writeDisk(root);
+}
+
+static bErrType valueWrite(const void *value, long len, bAdrType *head) {
+    bErrType rc;
+    bufType *buf;
+    bAdrType adr;
+    long cap;
+    long n;
+    long i;
+
+    cap = h->sectorSize - (sizeof(nodeType) - sizeof(keyType));
+    n = (len + cap - 1) / cap;
+    *head = 0;
+    for (i = n - 1; i >= 0; i--) {
+        if ((rc = allocAdr(&adr)) != 0) return rc;
+        if ((rc = assignBuf(adr, &buf)) != 0) return rc;
+        leaf(buf) = 1;
+        ct(buf) = 0;
+        childLT(fkey(buf)) = 0;
+        prev(buf) = 0;
+        next(buf) = *head;
+        memcpy(fkey(buf), (char *)value + i * cap, i == n - 1 ? len - i * cap : cap);
+        if ((rc = writeDisk(buf)) != 0) return rc;
+        *head = adr;
+    }
+    return bErrOk;
+}
+
+static bErrType valueFree(bAdrType adr) {
+    bErrType rc;
+    bufType *buf;
+    bAdrType nextAdr;
+
+    while (adr) {
+        if ((rc = readDisk(adr, &buf)) != 0) return rc;
+        nextAdr = next(buf);
+        if ((rc = freePage(adr)) != 0) return rc;
+        adr = nextAdr;
+    }
+    return bErrOk;
+}
+
+static bErrType valueFreeRange(bAdrType ref, int a, int b) {
+    bErrType rc;
+    bufType *buf;
+    keyType *k;
+    int i;
+
+    for (i = a; i < b; i++) {
+        if ((rc = readDisk(ref, &buf)) != 0) return rc;
+        k = fkey(buf) + lks(i);
+        if (valLen(k) > h->valueSize)
+            if ((rc = valueFree(bAdr(valData(k)))) != 0) return rc;
+    }
+    return bErrOk;
+}
+
+static bCntType subCount(bufType *buf) {
+    bCntType n;
+    int i;
+
+    if (leaf(buf)) return ct(buf);
+    n = 0;
+    for (i = 0; i <= ct(buf); i++)
+        n += cntN(buf, i);
+    return n;
+}
+
+static bErrType adjustCounts(int depth, bAdrType *adr, unsigned int *off, int delta) {
+    bErrType rc;
+    bufType *buf;
+    int i;
+
+    for (i = 0; i < depth; i++) {
+        if ((rc = readDisk(adr[i], &buf)) != 0) return rc;
+        bCnt(p(buf) + off[i]) += delta;
+        if ((rc = writeDisk(buf)) != 0) return rc;
+    }
+    return bErrOk;
+}
+
+static unsigned long filterHash(void *key) {
+    unsigned long hv;
+    unsigned char *k;
+    int i;
+
+    if (h->filter->hash) return h->filter->hash(key);
+    hv = 14695981039346656037UL;
+    k = key;
+    for (i = 0; i < h->keySize; i++) {
+        hv ^= k[i];
+        hv *= 1099511628211UL;
+    }
+    return hv;
+}
+
+static unsigned char *filterBlock(void *key, unsigned long *bits) {
+    unsigned long hv;
+
+    hv = filterHash(key);
+    *bits = hv * 0x9e3779b97f4a7c15UL;
+    return h->filter->bits + (hv % (h->filter->size / FILTER_BLOCK)) * FILTER_BLOCK;
+}
+
+static void filterAdd(void *key) {
+    unsigned char *blk;
+    unsigned long bits;
+    int bit;
+    int i;
+
+    blk = filterBlock(key, &bits);
+    for (i = 0; i < FILTER_PROBES; i++) {
+        bit = (bits >> (9 * i)) & (FILTER_BLOCK * 8 - 1);
+        blk[bit >> 3] |= 1 << (bit & 7);
+    }
+    h->filter->nIns++;
+}
+
+static bool filterHas(void *key) {
+    unsigned char *blk;
+    unsigned long bits;
+    int bit;
+    int i;
+
+    blk = filterBlock(key, &bits);
+    for (i = 0; i < FILTER_PROBES; i++) {
+        bit = (bits >> (9 * i)) & (FILTER_BLOCK * 8 - 1);
+        if (!(blk[bit >> 3] & (1 << (bit & 7)))) return false;
+    }
+    return true;
+}
+
+static bErrType filterBuild(void) {
+    bErrType rc;
+    bufType *buf;
+    keyType *k;
+    int i;
+
+    memset(h->filter->bits, 0, h->filter->size);
+    h->filter->nIns = 0;
+    h->filter->nDel = 0;
+    buf = &h->root;
+    while (!leaf(buf)) {
+        if ((rc = readDisk(childLT(fkey(buf)), &buf)) != 0) return rc;
+    }
+    while (1) {
+        for (k = fkey(buf), i = 0; i < ct(buf); i++, k += lks(1))
+            filterAdd(key(k));
+        if (!next(buf)) break;
+        if ((rc = readDisk(next(buf), &buf)) != 0) return rc;
+    }
+    return bErrOk;
+}
+
+static bErrType filterOpen(bOpenType *info, bool exists) {
+    filterType *f;
+    FILE *fp;
+    bufType *root;
+    long size;
+    long hdr[4];
+    bool ok;
+
+    size = info->filterSize / FILTER_BLOCK * FILTER_BLOCK;
+    if (size == 0) size = FILTER_BLOCK;
+    if ((f = malloc(sizeof(filterType) + size)) == NULL) return error(bErrMemory);
+    if ((f->name = malloc(strlen(info->iName) + 5)) == NULL) return error(bErrMemory);
+    sprintf(f->name, "%s.flt", info->iName);
+    f->bits = (unsigned char *)(f + 1);
+    f->size = size;
+    f->hash = info->hash;
+    h->filter = f;
+
+    if (exists && (fp = fopen(f->name, "rb")) != NULL) {
+        root = &h->root;
+        ok = fread(hdr, sizeof(hdr), 1, fp) == 1 && hdr[0] == size
+            && hdr[3] == modStamp(root) && fread(f->bits, size, 1, fp) == 1;
+        fclose(fp);
+        remove(f->name);
+        if (ok) {
+            f->nIns = hdr[1];
+            f->nDel = hdr[2];
+            return bErrOk;
+        }
+    }
+    return filterBuild();
+}
+
+static bErrType filterClose(void) {
+    filterType *f;
+    FILE *fp;
+    bufType *root;
+    long hdr[4];
+    bErrType rc;
+
+    f = h->filter;
+    root = &h->root;
+    hdr[0] = f->size;
+    hdr[1] = f->nIns;
+    hdr[2] = f->nDel;
+    hdr[3] = modStamp(root);
+    rc = bErrOk;
+    if ((fp = fopen(f->name, "wb")) == NULL) {
+        rc = error(bErrIO);
+    } else {
+        if (fwrite(hdr, sizeof(hdr), 1, fp) != 1
+            || fwrite(f->bits, f->size, 1, fp) != 1)
+            rc = error(bErrIO);
+        if (fclose(fp) || rc) {
+            remove(f->name);
+            rc = error(bErrIO);
+        }
+    }
+    free(f->name);
+    free(f);
+    h->filter = NULL;
+    return rc;
+}
+
+static bErrType pinLevels(bufType *buf, int depth) {
+    bErrType rc;
+    bufType *cbuf;
+    bAdrType *c;
+    int i;
+
+    for (i = 0; i <= ct(buf); i++) {
+        c = i ? &childGE(fkey(buf) + ks(i - 1)) : &childLT(fkey(buf));
+        if ((rc = pinAlloc(*c, &cbuf)) != 0) return rc;
+        if (fseek(h->fp, *c, SEEK_SET)) return error(bErrIO);
+        if (fread(cbuf->p, h->sectorSize, 1, h->fp) != 1) return error(bErrIO);
+        cbuf->valid = true;
+        nDiskReads++;
+        *c = bref(cbuf);
+        if (depth > 1)
+            if ((rc = pinLevels(cbuf, depth - 1)) != 0) return rc;
+    }
+    return bErrOk;
+}
+
+static bErrType pinOpen(void) {
+    bErrType rc;
+    bufType *buf;
+    int depth;
+
+    if ((h->pinList = malloc(sizeof(bufType) + 3 * h->sectorSize)) == NULL)
+        return error(bErrMemory);
+    h->pinList->next = h->pinList->prev = h->pinList;
+    h->pinList->p = (nodeType *)(h->pinList + 1);
+
+    depth = 0;
+    buf = &h->root;
+    while (!leaf(buf)) {
+        if ((rc = readDisk(childLT(fkey(buf)), &buf)) != 0) return rc;
+        depth++;
+    }
+    if (depth > 1)
+        if ((rc = pinLevels(&h->root, depth - 1)) != 0) return rc;
+
+    for (buf = h->bufList.next; buf != &h->bufList; buf = buf->next)
+        buf->valid = false;
+    if (h->pooled) poolRelease();
+    return bErrOk;
+}
+
+static bErrType curCheck(void) {
+    bErrType rc;
+    bufType *buf;
+    int off;
+
+    buf = h->curBuf;
+    if (buf == NULL || buf == &h->root) return bErrOk;
+    if (buf->owner == h && buf->adr == h->curAdr && buf->valid) return bErrOk;
+    off = h->curKey - fkey(buf);
+    if ((rc = readDisk(h->curAdr, &buf)) != 0) return rc;
+    h->curBuf = buf;
+    h->curKey = fkey(buf) + off;
+    return bErrOk;
+}
+
 typedef enum { MODE_FIRST, MODE_MATCH } modeEnum;
 
 static int search(bufType *buf, void *key, keyType **mkey, modeEnum mode) {
@@ -137,7 +778,7 @@ static int search(bufType *buf, void *key, keyType **mkey, modeEnum mode) {
     ub = ct(buf) - 1;
     while (lb <= ub) {
         m = (lb + ub) / 2;
-        *mkey = fkey(buf) + ks(m);
+        *mkey = fkey(buf) + nks(buf, m);
         cc = h->comp(key, key(*mkey));
         if (cc < 0)
             ub = m - 1;
@@ -161,10 +802,16 @@ static bErrType scatterRoot(void) {
 
     root = &h->root;
     gbuf = &h->gbuf;
-    memcpy(fkey(root), fkey(gbuf), ks(ct(gbuf)));
+    memcpy(fkey(root), fkey(gbuf), nks(gbuf, ct(gbuf)));
     childLT(fkey(root)) = childLT(fkey(gbuf));
     ct(root) = ct(gbuf);
     leaf(root) = leaf(gbuf);
+    if (h->counted) {
+        if (leaf(root))
+            next(root) = 0;
+        else
+            cntLT(fkey(root)) = cntLT(fkey(gbuf));
+    }
     return bErrOk;
 }
 
@@ -183,6 +830,8 @@ static bErrType scatter(bufType *pbuf, keyType *pkey, int is, bufType **tmp) {
     int extra;
     int ct;
     int i;
+    keyType *ckey;
+    bAdrType adr;
 
     gbuf = &h->gbuf;
     gkey = fkey(gbuf);
@@ -191,10 +840,10 @@ static bErrType scatter(bufType *pbuf, keyType *pkey, int is, bufType **tmp) {
     iu = is;
 
     if (leaf(gbuf)) {
-        k0Max= h->maxCt - 1;
-        knMax= h->maxCt - 1;
-        k0Min= (h->maxCt / 2) + 1;
-        knMin= (h->maxCt / 2) + 1;
+        k0Max= h->lMaxCt - 1;
+        knMax= h->lMaxCt - 1;
+        k0Min= (h->lMaxCt / 2) + 1;
+        knMin= (h->lMaxCt / 2) + 1;
     } else {
         k0Max = h->maxCt - 1;
         knMax = h->maxCt;
@@ -204,8 +853,12 @@ static bErrType scatter(bufType *pbuf, keyType *pkey, int is, bufType **tmp) {
 
     while(1) {
         if (iu == 0 || ct > (k0Max + (iu-1)*knMax)) {
-            if ((rc = assignBuf(allocAdr(), &tmp[iu])) != 0)
-                return rc;
+            if ((rc = allocAdr(&adr)) != 0) return rc;
+            if (h->pinList && !leaf(gbuf))
+                rc = pinNew(adr, &tmp[iu]);
+            else
+                rc = assignBuf(adr, &tmp[iu]);
+            if (rc != 0) return rc;
             if (leaf(gbuf)) {
                 if (iu == 0) {
                     prev(tmp[0]) = 0;
@@ -218,12 +871,15 @@ static bErrType scatter(bufType *pbuf, keyType *pkey, int is, bufType **tmp) {
             }
             iu++;
             nNodesIns++;
-        } else if (iu > 1 && ct < (k0Min + (iu-1)*knMin)) {
+        } else if (iu > 1 && ct < (k0Min + (iu-1)*knMin) && ct <= (k0Max + (iu-2)*knMax)) {
             iu--;
             if (leaf(gbuf) && tmp[iu-1]->adr) {
                 next(tmp[iu-1]) = next(tmp[iu]);
             }
             next(tmp[iu-1]) = next(tmp[iu]);
+            adr = tmp[iu]->adr;
+            if (tmp[iu]->pinned) unpin(tmp[iu]);
+            if ((rc = freePage(adr)) != 0) return rc;
             nNodesDel++;
         } else {
             break;
@@ -264,37 +920,51 @@ static bErrType scatter(bufType *pbuf, keyType *pkey, int is, bufType **tmp) {
             ct(pbuf) += iu - is - 1;
     }
 
+    ckey = pkey;
     for (i = 0; i < iu; i++) {
         if (leaf(gbuf)) {
             childLT(fkey(tmp[i])) = 0;
             if (i == 0) {
-                childLT(pkey) = tmp[i]->adr;
+                childLT(pkey) = bref(tmp[i]);
             } else {
                 memcpy(pkey, gkey, ks(1));
-                childGE(pkey) = tmp[i]->adr;
+                childGE(pkey) = bref(tmp[i]);
                 pkey += ks(1);
             }
         } else {
             if (i == 0) {
                 childLT(fkey(tmp[i])) = childLT(gkey);
-                childLT(pkey) = tmp[i]->adr;
+                if (h->counted) cntLT(fkey(tmp[i])) = cntLT(gkey);
+                childLT(pkey) = bref(tmp[i]);
             } else {
                 childLT(fkey(tmp[i])) = childGE(gkey);
+                if (h->counted) cntLT(fkey(tmp[i])) = cntGE(gkey);
                 memcpy(pkey, gkey, ks(1));
-                childGE(pkey) = tmp[i]->adr;
+                childGE(pkey) = bref(tmp[i]);
                 gkey += ks(1);
                 pkey += ks(1);
                 ct(tmp[i])--;
             }
         }
 
-        memcpy(fkey(tmp[i]), gkey, ks(ct(tmp[i])));
+        memcpy(fkey(tmp[i]), gkey, nks(gbuf, ct(tmp[i])));
         leaf(tmp[i]) = leaf(gbuf);
 
-        gkey += ks(ct(tmp[i]));
+        gkey += nks(gbuf, ct(tmp[i]));
     }
     leaf(pbuf) = false;
 
+    if (h->counted) {
+        for (i = 0; i < iu; i++) {
+            if (i == 0) {
+                cntLT(ckey) = subCount(tmp[i]);
+            } else {
+                cntGE(ckey) = subCount(tmp[i]);
+                ckey += ks(1);
+            }
+        }
+    }
+
     if ((rc = writeDisk(pbuf)) != 0) return rc;
     for (i = 0; i < iu; i++)
         if ((rc = writeDisk(tmp[i])) != 0) return rc;
@@ -302,11 +972,24 @@ static bErrType scatter(bufType *pbuf, keyType *pkey, int is, bufType **tmp) {
     return bErrOk;
 }
 
-static bErrType gatherRoot(void) {
-    bufType *gbuf;
-    bufType *root;
+static bErrType dropNodes(bufType **tmp, int n) {
+    bErrType rc;
+    bAdrType adr;
+    int i;
 
-    root = &h->root;
+    for (i = 0; i < n; i++) {
+        adr = tmp[i]->adr;
+        if (tmp[i]->pinned) unpin(tmp[i]);
+        if ((rc = freePage(adr)) != 0) return rc;
+    }
+    return bErrOk;
+}
+
+static bErrType gatherRoot(void) {
+    bufType *gbuf;
+    bufType *root;
+
+    root = &h->root;
     gbuf = &h->gbuf;
     memcpy(p(gbuf), root->p, 3 * h->sectorSize);
     leaf(gbuf) = leaf(root);
@@ -329,27 +1012,31 @@ static bErrType gather(bufType *pbuf, keyType **pkey, bufType **tmp) {
     gkey = fkey(gbuf);
 
     childLT(gkey) = childLT(fkey(tmp[0]));
-    memcpy(gkey, fkey(tmp[0]), ks(ct(tmp[0])));
-    gkey += ks(ct(tmp[0]));
+    if (h->counted && !leaf(tmp[0]))
+        cntLT(gkey) = cntLT(fkey(tmp[0]));
+    memcpy(gkey, fkey(tmp[0]), nks(tmp[0], ct(tmp[0])));
+    gkey += nks(tmp[0], ct(tmp[0]));
     ct(gbuf) = ct(tmp[0]);
 
     if (!leaf(tmp[1])) {
         memcpy(gkey, *pkey, ks(1));
         childGE(gkey) = childLT(fkey(tmp[1]));
+        if (h->counted) cntGE(gkey) = cntLT(fkey(tmp[1]));
         ct(gbuf)++;
         gkey += ks(1);
     }
-    memcpy(gkey, fkey(tmp[1]), ks(ct(tmp[1])));
-    gkey += ks(ct(tmp[1]));
+    memcpy(gkey, fkey(tmp[1]), nks(tmp[1], ct(tmp[1])));
+    gkey += nks(tmp[1], ct(tmp[1]));
     ct(gbuf) += ct(tmp[1]);
 
     if (!leaf(tmp[2])) {
         memcpy(gkey, *pkey+ks(1), ks(1));
         childGE(gkey) = childLT(fkey(tmp[2]));
+        if (h->counted) cntGE(gkey) = cntLT(fkey(tmp[2]));
         ct(gbuf)++;
         gkey += ks(1);
     }
-    memcpy(gkey, fkey(tmp[2]), ks(ct(tmp[2])));
+    memcpy(gkey, fkey(tmp[2]), nks(tmp[2], ct(tmp[2])));
     ct(gbuf) += ct(tmp[2]);
 
     leaf(gbuf) = leaf(tmp[0]);
@@ -357,21 +1044,162 @@ static bErrType gather(bufType *pbuf, keyType **pkey, bufType **tmp) {
     return bErrOk;
 }
 
+typedef struct asyncTag {
+    struct asyncTag *next;
+    bool step;
+    bool ready;
+    bAdrType adr;
+    unsigned long writeSeq;
+    bErrType rc;
+    eAdrType rec;
+    bDoneType done;
+    void *arg;
+    char *key;
+    char *page;
+} asyncType;
+
+typedef struct ioTag {
+    pthread_t *tid;
+    int nThreads;
+    int fd;
+    int sectorSize;
+    int wake[2];
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    asyncType *todo;
+    asyncType **todoTail;
+    asyncType *done;
+    asyncType **doneTail;
+    bool stop;
+} ioType;
+
+static void *ioWorker(void *arg) {
+    ioType *io;
+    asyncType *a;
+
+    io = arg;
+    pthread_mutex_lock(&io->lock);
+    while (1) {
+        while (io->todo == NULL && !io->stop)
+            pthread_cond_wait(&io->cond, &io->lock);
+        if (io->stop) break;
+        a = io->todo;
+        if ((io->todo = a->next) == NULL) io->todoTail = &io->todo;
+        pthread_mutex_unlock(&io->lock);
+
+        if (pread(io->fd, a->page, io->sectorSize, a->adr) == io->sectorSize)
+            a->rc = bErrOk;
+        else
+            a->rc = bErrIO;
+
+        pthread_mutex_lock(&io->lock);
+        a->next = NULL;
+        *io->doneTail = a;
+        io->doneTail = &a->next;
+        if (write(io->wake[1], "", 1) < 0) {}
+    }
+    pthread_mutex_unlock(&io->lock);
+    return NULL;
+}
+
+static void ioFree(asyncType *a) {
+    asyncType *t;
+    hNode *owner;
+    bErrType rc;
+
+    owner = h;
+    while (a) {
+        t = a->next;
+        rc = a->ready ? a->rc : bErrFileNotOpen;
+        a->done(a->arg, rc, rc ? NULL : a->key, a->rec);
+        free(a);
+        a = t;
+        h = owner;
+    }
+}
+
+static bErrType ioClose(void) {
+    ioType *io;
+    int i;
+
+    io = h->io;
+    pthread_mutex_lock(&io->lock);
+    io->stop = true;
+    pthread_cond_broadcast(&io->cond);
+    pthread_mutex_unlock(&io->lock);
+    for (i = 0; i < io->nThreads; i++)
+        pthread_join(io->tid[i], NULL);
+    pthread_cond_destroy(&io->cond);
+    pthread_mutex_destroy(&io->lock);
+    ioFree(io->done);
+    ioFree(io->todo);
+    close(io->wake[0]);
+    close(io->wake[1]);
+    free(io->tid);
+    free(io);
+    h->io = NULL;
+    return bErrOk;
+}
+
+static bErrType ioOpen(int nThreads) {
+    ioType *io;
+    int i;
+
+    if ((io = malloc(sizeof(ioType))) == NULL) return error(bErrMemory);
+    memset(io, 0, sizeof(ioType));
+    if ((io->tid = malloc(nThreads * sizeof(pthread_t))) == NULL) {
+        free(io);
+        return error(bErrMemory);
+    }
+    if (pipe(io->wake)) {
+        free(io->tid);
+        free(io);
+        return error(bErrIO);
+    }
+    fcntl(io->wake[0], F_SETFL, fcntl(io->wake[0], F_GETFL) | O_NONBLOCK);
+    fcntl(io->wake[1], F_SETFL, fcntl(io->wake[1], F_GETFL) | O_NONBLOCK);
+    io->fd = fileno(h->fp);
+    io->sectorSize = h->sectorSize;
+    io->todoTail = &io->todo;
+    io->doneTail = &io->done;
+    pthread_mutex_init(&io->lock, NULL);
+    pthread_cond_init(&io->cond, NULL);
+    h->io = io;
+    for (i = 0; i < nThreads; i++) {
+        if (pthread_create(&io->tid[i], NULL, ioWorker, io)) break;
+        io->nThreads++;
+    }
+    if (io->nThreads == 0) {
+        ioClose();
+        return error(bErrMemory);
+    }
+    return bErrOk;
+}
+
 bErrType bOpen(bOpenType info, bHandleType *handle) {
     bErrType rc;
     int bufCt;
     bufType *buf;
     int maxCt;
+    int lMaxCt;
     bufType *root;
     int i;
     nodeType *p;
 
-    if ((info.sectorSize < sizeof(hNode)) || (info.sectorSize % 4))
+    if (info.sectorSize % 4)
         return bErrSectorSize;
+    if (info.valueSize && info.valueSize < (int)sizeof(bAdrType))
+        info.valueSize = sizeof(bAdrType);
+    info.valueSize = (info.valueSize + sizeof(long) - 1) & ~(sizeof(long) - 1);
 
     maxCt = info.sectorSize - (sizeof(nodeType) - sizeof(keyType));
-    maxCt /= sizeof(bAdrType) + info.keySize + sizeof(eAdrType);
-    if (maxCt < 6) return bErrSectorSize;
+    lMaxCt = maxCt;
+    maxCt /= sizeof(bAdrType) + info.keySize + sizeof(eAdrType)
+        + (info.counted ? sizeof(bCntType) : 0);
+    lMaxCt /= sizeof(bAdrType) + info.keySize + sizeof(eAdrType)
+        + (info.counted ? sizeof(bCntType) : 0)
+        + (info.valueSize ? sizeof(long) + info.valueSize : 0);
+    if (lMaxCt < 6) return bErrSectorSize;
 
 
     if ((h = malloc(sizeof(hNode))) == NULL) return error(bErrMemory);
@@ -379,34 +1207,52 @@ bErrType bOpen(bOpenType info, bHandleType *handle) {
     h->keySize = info.keySize;
     h->sectorSize = info.sectorSize;
     h->comp = info.comp;
+    h->counted = info.counted;
 
 
     h->ks = sizeof(bAdrType) + h->keySize + sizeof(eAdrType);
+    if (h->counted) h->ks += sizeof(bCntType);
     h->maxCt = maxCt;
+    h->lks = h->ks;
+    h->lMaxCt = lMaxCt;
+
+    h->valueSize = info.valueSize;
+    if (h->valueSize) {
+        h->lks += sizeof(long) + h->valueSize;
+        if ((h->valSlot = malloc(sizeof(long) + h->valueSize)) == NULL)
+            return error(bErrMemory);
+        *(long *)h->valSlot = 0;
+    }
 
-    bufCt = 7;
-    if ((h->malloc1 = malloc(bufCt * sizeof(bufType))) == NULL)
+    h->pooled = pool != NULL;
+    bufCt = h->pooled ? 0 : 7;
+    if (bufCt && (h->malloc1 = malloc(bufCt * sizeof(bufType))) == NULL)
         return error(bErrMemory);
     buf = h->malloc1;
 
-    if ((h->malloc2 = malloc((bufCt+6) * h->sectorSize + 2 * h->ks)) == NULL)
+    if ((h->malloc2 = malloc((bufCt+6) * h->sectorSize + 2 * h->lks)) == NULL)
         return error(bErrMemory);
     p = h->malloc2;
 
 
-    h->bufList.next = buf;
-    h->bufList.prev = buf + (bufCt - 1);
-    for (i = 0; i < bufCt; i++) {
-        buf->next = buf + 1;
-        buf->prev = buf - 1;
-        buf->modified = false;
-        buf->valid = false;
-        buf->p = p;
-        p = (nodeType *)((char *)p + h->sectorSize);
-        buf++;
+    h->bufList.next = h->bufList.prev = &h->bufList;
+    if (bufCt) {
+        h->bufList.next = buf;
+        h->bufList.prev = buf + (bufCt - 1);
+        for (i = 0; i < bufCt; i++) {
+            buf->next = buf + 1;
+            buf->prev = buf - 1;
+            buf->modified = false;
+            buf->valid = false;
+            buf->pinned = false;
+            buf->owner = h;
+            buf->p = p;
+            p = (nodeType *)((char *)p + h->sectorSize);
+            buf++;
+        }
+        h->bufList.next->prev = &h->bufList;
+        h->bufList.prev->next = &h->bufList;
     }
-    h->bufList.next->prev = &h->bufList;
-    h->bufList.prev->next = &h->bufList;
 
     root = &h->root;
     root->p = p;
@@ -420,17 +1266,28 @@ bErrType bOpen(bOpenType info, bHandleType *handle) {
         if ((rc = readDisk(0, &root)) != 0) return rc;
         if (fseek(h->fp, 0, SEEK_END)) return error(bErrIO);
         if ((h->nextFreeAdr = ftell(h->fp)) == -1) return error(bErrIO);
+        if (info.filterSize)
+            if ((rc = filterOpen(&info, true)) != 0) return rc;
     } else if ((h->fp = fopen(info.iName, "w+b")) != NULL) {
         memset(root->p, 0, 3*h->sectorSize);
         leaf(root) = 1;
+        root->valid = true;
         h->nextFreeAdr = 3 * h->sectorSize;
+        if (info.filterSize)
+            if ((rc = filterOpen(&info, false)) != 0) return rc;
     } else {
         free(h);
         return bErrFileNotOpen;
     }
 
+    if (info.pinned)
+        if ((rc = pinOpen()) != 0) return rc;
+    if (info.ioThreads > 0)
+        if ((rc = ioOpen(info.ioThreads)) != 0) return rc;
+    if (h->pooled) pool->nHandles++;
+
     if (hList.next) {
-        h->prev = hList.next;
+        h->prev = hList.prev;
         h->next = &hList;
         h->prev->next = h;
         h->next->prev = h;
@@ -453,10 +1310,23 @@ bErrType bClose(bHandleType handle) {
         h->prev->next = h->next;
     }
 
+    if (h->io) ioClose();
     if (h->fp) {
         flushAll();
         fclose(h->fp);
     }
+    if (h->pooled) {
+        poolRelease();
+        pool->nHandles--;
+    }
+    if (h->filter) filterClose();
+    if (h->pinList) {
+        while (h->pinList->next != h->pinList)
+            unpin(h->pinList->next);
+        free(h->pinList);
+    }
+    if (h->defragKey) free(h->defragKey);
+    if (h->valSlot) free(h->valSlot);
 
     if (h->malloc2) free(h->malloc2);
     if (h->malloc1) free(h->malloc1);
@@ -464,19 +1334,15 @@ bErrType bClose(bHandleType handle) {
     return bErrOk;
 }
 
-bErrType bFindKey(bHandleType handle, void *key, eAdrType *rec) {
+static bErrType findFrom(bufType *buf, void *key, eAdrType *rec) {
     keyType *mkey;
-    bufType *buf;
     bErrType rc;
 
-    h = handle;
-    buf = &h->root;
-
     while (1) {
         if (leaf(buf)) {
             if (search(buf, key, &mkey, MODE_FIRST) == 0) {
                 *rec = rec(mkey);
-                h->curBuf = buf; h->curKey = mkey;
+                h->curBuf = buf; h->curKey = mkey; h->curAdr = buf->adr;
                 return bErrOk;
             } else {
                 return bErrKeyNotFound;
@@ -491,6 +1357,12 @@ bErrType bFindKey(bHandleType handle, void *key, eAdrType *rec) {
     }
 }
 
+bErrType bFindKey(bHandleType handle, void *key, eAdrType *rec) {
+    h = handle;
+    if (h->filter && !filterHas(key)) return bErrKeyNotFound;
+    return findFrom(&h->root, key, rec);
+}
+
 bErrType bInsertKey(bHandleType handle, void *key, eAdrType rec) {
     int rc;
     keyType *mkey;
@@ -504,13 +1376,15 @@ bErrType bInsertKey(bHandleType handle, void *key, eAdrType rec) {
     bAdrType lastGE;
     unsigned int lastGEkey;
     int height;
+    bAdrType pathAdr[MAX_HEIGHT];
+    unsigned int pathOff[MAX_HEIGHT];
 
     h = handle;
     root = &h->root;
     lastGEvalid = false;
     lastLTvalid = false;
 
-    if (ct(root) == 3 * h->maxCt) {
+    if (ct(root) == 3 * nMax(root)) {
         if ((rc = gatherRoot()) != 0) return rc;
         if ((rc = scatter(root, fkey(root), 0, tmp)) != 0) return rc;
     }
@@ -531,16 +1405,17 @@ bErrType bInsertKey(bHandleType handle, void *key, eAdrType rec) {
             case CC_GT:
                 if (h->comp(key, mkey) == CC_EQ)
                     return bErrDupKeys;
-                mkey += ks(1);
+                mkey += lks(1);
                 break;
             }
 
             keyOff = mkey - fkey(buf);
-            len = ks(ct(buf)) - keyOff;
-            if (len) memmove(mkey + ks(1), mkey, len);
+            len = lks(ct(buf)) - keyOff;
+            if (len) memmove(mkey + lks(1), mkey, len);
 
             memcpy(key(mkey), key, h->keySize);
             rec(mkey) = rec;
+            if (h->valueSize) memcpy(val(mkey), h->valSlot, sizeof(long) + h->valueSize);
             childGE(mkey) = 0;
             ct(buf)++;
             if ((rc = writeDisk(buf)) != 0) return rc;
@@ -553,6 +1428,9 @@ bErrType bInsertKey(bHandleType handle, void *key, eAdrType rec) {
                 rec(tkey) = rec;
                 if ((rc = writeDisk(tbuf)) != 0) return rc;
             }
+            if (h->counted)
+                if ((rc = adjustCounts(height, pathAdr, pathOff, 1)) != 0) return rc;
+            if (h->filter) filterAdd(key);
             nKeysIns++;
             break;
         } else {
@@ -565,7 +1443,7 @@ bErrType bInsertKey(bHandleType handle, void *key, eAdrType rec) {
                 if ((rc = readDisk(childGE(mkey), &cbuf)) != 0) return rc;
             }
 
-            if (ct(cbuf) == h->maxCt) {
+            if (ct(cbuf) == nMax(cbuf)) {
                 if ((rc = gather(buf, &mkey, tmp)) != 0) return rc;
                 if ((rc = scatter(buf, mkey, 3, tmp)) != 0) return rc;
 
@@ -578,12 +1456,19 @@ bErrType bInsertKey(bHandleType handle, void *key, eAdrType rec) {
             if (cc >= 0 || mkey != fkey(buf)) {
                 lastGEvalid = true;
                 lastLTvalid = false;
-                lastGE = buf->adr;
+                lastGE = bref(buf);
                 lastGEkey = mkey - fkey(buf);
                 if (cc < 0) lastGEkey -= ks(1);
             } else {
                 if (lastGEvalid) lastLTvalid = true;
             }
+            if (h->counted) {
+                pathAdr[height - 1] = bref(buf);
+                if (cc < 0)
+                    pathOff[height - 1] = (char *)&cntLT(mkey) - p(buf);
+                else
+                    pathOff[height - 1] = (char *)&cntGE(mkey) - p(buf);
+            }
             buf = cbuf;
         }
     }
@@ -591,6 +1476,26 @@ bErrType bInsertKey(bHandleType handle, void *key, eAdrType rec) {
     return bErrOk;
 }
 
+bErrType bInsertValue(bHandleType handle, void *key, eAdrType rec, const void *value, long len) {
+    bErrType rc;
+    bAdrType head;
+
+    h = handle;
+    if (!h->valueSize) return bErrNoValues;
+    head = 0;
+    if (len > h->valueSize) {
+        if ((rc = valueWrite(value, len, &head)) != 0) return rc;
+        bAdr(h->valSlot + sizeof(long)) = head;
+    } else {
+        memcpy(h->valSlot + sizeof(long), value, len);
+    }
+    *(long *)h->valSlot = len;
+    rc = bInsertKey(handle, key, rec);
+    *(long *)h->valSlot = 0;
+    if (rc != 0 && head) valueFree(head);
+    return rc;
+}
+
 bErrType bDeleteKey(bHandleType handle, void *key) {
     int rc;
     keyType *mkey;
@@ -605,6 +1510,10 @@ bErrType bDeleteKey(bHandleType handle, void *key) {
     unsigned int lastGEkey;
     bufType *root;
     bufType *gbuf;
+    int depth;
+    bAdrType pathAdr[MAX_HEIGHT];
+    unsigned int pathOff[MAX_HEIGHT];
+    bAdrType ovf;
 
     h = handle;
     root = &h->root;
@@ -612,15 +1521,19 @@ bErrType bDeleteKey(bHandleType handle, void *key) {
     lastGEvalid = false;
     lastLTvalid = false;
 
+    if (h->filter && !filterHas(key)) return bErrKeyNotFound;
     buf = root;
+    depth = 0;
     while(1) {
         if (leaf(buf)) {
             if (search(buf, key, &mkey, MODE_MATCH) != 0)
                 return bErrKeyNotFound;
 
             keyOff = mkey - fkey(buf);
-            len = ks(ct(buf)-1) - keyOff;
-            if (len) memmove(mkey, mkey + ks(1), len);
+            ovf = 0;
+            if (h->valueSize && valLen(mkey) > h->valueSize) ovf = bAdr(valData(mkey));
+            len = lks(ct(buf)-1) - keyOff;
+            if (len) memmove(mkey, mkey + lks(1), len);
             ct(buf)--;
             if ((rc = writeDisk(buf)) != 0) return rc;
             if (!keyOff && lastLTvalid) {
@@ -632,6 +1545,12 @@ bErrType bDeleteKey(bHandleType handle, void *key) {
                 rec(tkey) = rec(mkey);
                 if ((rc = writeDisk(tbuf)) != 0) return rc;
             }
+            if (h->counted)
+                if ((rc = adjustCounts(depth, pathAdr, pathOff, -1)) != 0) return rc;
+            if (h->filter && 2 * ++h->filter->nDel > h->filter->nIns)
+                if ((rc = filterBuild()) != 0) return rc;
+            if (ovf)
+                if ((rc = valueFree(ovf)) != 0) return rc;
             nKeysDel++;
             break;
         } else {
@@ -643,10 +1562,11 @@ bErrType bDeleteKey(bHandleType handle, void *key) {
                 if ((rc = readDisk(childGE(mkey), &cbuf)) != 0) return rc;
             }
 
-            if (ct(cbuf) == h->maxCt/2) {
+            if (ct(cbuf) <= nMax(cbuf)/2) {
                 if ((rc = gather(buf, &mkey, tmp)) != 0) return rc;
-                if (buf == root && ct(root) == 2 && ct(gbuf) < (3*(3*h->maxCt))/4) {
+                if (buf == root && ct(root) == 2 && ct(gbuf) < (3*(3*nMax(gbuf)))/4) {
                     scatterRoot();
+                    if ((rc = dropNodes(tmp, 3)) != 0) return rc;
                     nNodesDel += 3;
                     continue;
                 }
@@ -661,12 +1581,20 @@ bErrType bDeleteKey(bHandleType handle, void *key) {
             if (cc >= 0 || mkey != fkey(buf)) {
                 lastGEvalid = true;
                 lastLTvalid = false;
-                lastGE = buf->adr;
+                lastGE = bref(buf);
                 lastGEkey = mkey - fkey(buf);
                 if (cc < 0) lastGEkey -= ks(1);
             } else {
                 if (lastGEvalid) lastLTvalid = true;
             }
+            if (h->counted) {
+                pathAdr[depth] = bref(buf);
+                if (cc < 0)
+                    pathOff[depth] = (char *)&cntLT(mkey) - p(buf);
+                else
+                    pathOff[depth] = (char *)&cntGE(mkey) - p(buf);
+            }
+            depth++;
             buf = cbuf;
         }
     }
@@ -686,7 +1614,7 @@ bErrType bFindFirstKey(bHandleType handle, void *key, eAdrType *rec) {
     if (ct(buf) == 0) return bErrKeyNotFound;
     memcpy(key, key(fkey(buf)), h->keySize);
     *rec = rec(fkey(buf));
-    h->curBuf = buf; h->curKey = fkey(buf);
+    h->curBuf = buf; h->curKey = fkey(buf); h->curAdr = buf->adr;
     return bErrOk;
 }
 
@@ -702,7 +1630,7 @@ bErrType bFindLastKey(bHandleType handle, void *key, eAdrType *rec) {
     if (ct(buf) == 0) return bErrKeyNotFound;
     memcpy(key, key(lkey(buf)), h->keySize);
     *rec = rec(lkey(buf));
-    h->curBuf = buf; h->curKey = lkey(buf);
+    h->curBuf = buf; h->curKey = lkey(buf); h->curAdr = buf->adr;
     return bErrOk;
 }
 
@@ -712,6 +1640,7 @@ bErrType bFindNextKey(bHandleType handle, void *key, eAdrType *rec) {
     bufType *buf;
 
     h = handle;
+    if ((rc = curCheck()) != 0) return rc;
     if ((buf = h->curBuf) == NULL) return bErrKeyNotFound;
     if (h->curKey == lkey(buf)) {
         if (next(buf)) {
@@ -721,11 +1650,11 @@ bErrType bFindNextKey(bHandleType handle, void *key, eAdrType *rec) {
             return bErrKeyNotFound;
         }
     } else {
-        nkey = h->curKey + ks(1);
+        nkey = h->curKey + lks(1);
     }
     memcpy(key, key(nkey), h->keySize);
     *rec = rec(nkey);
-    h->curBuf = buf; h->curKey = nkey;
+    h->curBuf = buf; h->curKey = nkey; h->curAdr = buf->adr;
     return bErrOk;
 }
 
@@ -736,22 +1665,1110 @@ bErrType bFindPrevKey(bHandleType handle, void *key, eAdrType *rec) {
     bufType *buf;
 
     h = handle;
+    if ((rc = curCheck()) != 0) return rc;
     if ((buf = h->curBuf) == NULL) return bErrKeyNotFound;
     fkey = fkey(buf);
     if (h->curKey == fkey) {
         if (prev(buf)) {
             if ((rc = readDisk(prev(buf), &buf)) != 0) return rc;
-            pkey = fkey(buf) + ks((ct(buf) - 1));
+            pkey = fkey(buf) + lks(ct(buf) - 1);
         } else {
 
             return bErrKeyNotFound;
         }
     } else {
 
-        pkey = h->curKey - ks(1);
+        pkey = h->curKey - lks(1);
     }
     memcpy(key, key(pkey), h->keySize);
     *rec = rec(pkey);
-    h->curBuf = buf; h->curKey = pkey;
+    h->curBuf = buf; h->curKey = pkey; h->curAdr = buf->adr;
+    return bErrOk;
+}
+
+bErrType bCurValue(bHandleType handle, void *value, long size, long *len) {
+    bErrType rc;
+    bufType *buf;
+    bAdrType adr;
+    long cap;
+    long off;
+    long n;
+
+    h = handle;
+    if (!h->valueSize) return bErrNoValues;
+    if ((rc = curCheck()) != 0) return rc;
+    if (h->curBuf == NULL) return bErrKeyNotFound;
+    *len = valLen(h->curKey);
+    if (*len <= h->valueSize) {
+        memcpy(value, valData(h->curKey), *len < size ? *len : size);
+        return bErrOk;
+    }
+
+    cap = h->sectorSize - (sizeof(nodeType) - sizeof(keyType));
+    adr = bAdr(valData(h->curKey));
+    for (off = 0; adr && off < *len && off < size; off += n) {
+        if ((rc = readDisk(adr, &buf)) != 0) return rc;
+        n = *len - off < cap ? *len - off : cap;
+        if (n > size - off) n = size - off;
+        memcpy((char *)value + off, fkey(buf), n);
+        adr = next(buf);
+    }
     return bErrOk;
 }
+
+static bErrType rankOf(void *key, bool incl, bCntType *rank) {
+    bErrType rc;
+    bufType *buf;
+    keyType *mkey;
+    bCntType n;
+    int cc;
+    int i;
+    int j;
+
+    n = 0;
+    buf = &h->root;
+    while (!leaf(buf)) {
+        cc = search(buf, key, &mkey, MODE_MATCH);
+        j = (mkey - fkey(buf)) / h->ks;
+        if (cc >= 0) j++;
+        for (i = 0; i < j; i++)
+            n += cntN(buf, i);
+        if ((rc = readDisk(childN(buf, j), &buf)) != 0) return rc;
+    }
+    cc = search(buf, key, &mkey, MODE_MATCH);
+    if (ct(buf)) {
+        n += (mkey - fkey(buf)) / h->lks;
+        if (cc > 0 || (cc == 0 && incl)) n++;
+    }
+    *rank = n;
+    return bErrOk;
+}
+
+bErrType bCountRange(bHandleType handle, void *lo, void *hi, bCntType *count) {
+    bErrType rc;
+    bCntType nlo;
+    bCntType nhi;
+
+    h = handle;
+    if (!h->counted) return bErrNotCounted;
+    if ((rc = rankOf(lo, false, &nlo)) != 0) return rc;
+    if ((rc = rankOf(hi, true, &nhi)) != 0) return rc;
+    *count = nhi > nlo ? nhi - nlo : 0;
+    return bErrOk;
+}
+
+bErrType bSeekRank(bHandleType handle, bCntType rank, void *key, eAdrType *rec) {
+    bErrType rc;
+    bufType *buf;
+    keyType *mkey;
+    int i;
+
+    h = handle;
+    if (!h->counted) return bErrNotCounted;
+    if (rank < 0) return bErrKeyNotFound;
+    buf = &h->root;
+    while (!leaf(buf)) {
+        for (i = 0; i <= ct(buf); i++) {
+            if (rank < cntN(buf, i)) break;
+            rank -= cntN(buf, i);
+        }
+        if (i > ct(buf)) return bErrKeyNotFound;
+        if ((rc = readDisk(childN(buf, i), &buf)) != 0) return rc;
+    }
+    if (rank >= ct(buf)) return bErrKeyNotFound;
+    mkey = fkey(buf) + lks(rank);
+    memcpy(key, key(mkey), h->keySize);
+    *rec = rec(mkey);
+    h->curBuf = buf; h->curKey = mkey; h->curAdr = buf->adr;
+    return bErrOk;
+}
+
+typedef struct {
+    int fd;
+    int keySize;
+    int ks;
+    int sectorSize;
+    bAdrType *first;
+    int nRanges;
+    int nextRange;
+    pthread_mutex_t lock;
+    bScanType scan;
+    void *arg;
+    char *outName;
+    bool stop;
+    bErrType rc;
+} scanType;
+
+static void scanError(scanType *sc, bErrType rc) {
+    pthread_mutex_lock(&sc->lock);
+    if (!sc->rc) sc->rc = rc;
+    sc->stop = true;
+    pthread_mutex_unlock(&sc->lock);
+}
+
+static void *scanWorker(void *arg) {
+    scanType *sc;
+    char *ra;
+    bAdrType raAdr;
+    long raLen;
+    long raPages;
+    bAdrType lastAdr;
+    nodeType *p;
+    bAdrType adr;
+    char *k;
+    FILE *out;
+    char *name;
+    int r;
+    int i;
+
+    sc = arg;
+    name = NULL;
+    if ((ra = malloc(SCAN_AHEAD * sc->sectorSize)) == NULL
+        || (sc->outName && (name = malloc(strlen(sc->outName) + 12)) == NULL)) {
+        scanError(sc, bErrMemory);
+        free(ra);
+        return NULL;
+    }
+    raAdr = 0;
+    raLen = 0;
+    raPages = 1;
+    lastAdr = 0;
+    while (1) {
+        pthread_mutex_lock(&sc->lock);
+        r = sc->stop ? sc->nRanges : sc->nextRange++;
+        pthread_mutex_unlock(&sc->lock);
+        if (r >= sc->nRanges) break;
+
+        out = NULL;
+        if (name) {
+            sprintf(name, "%s.%d", sc->outName, r);
+            if ((out = fopen(name, "wb")) == NULL) {
+                scanError(sc, bErrIO);
+                break;
+            }
+        }
+        for (adr = sc->first[r]; adr && adr != sc->first[r + 1]; adr = p->next) {
+            if (adr < raAdr || adr + sc->sectorSize > raAdr + raLen) {
+                if (adr == lastAdr + sc->sectorSize)
+                    raPages = raPages * 2 > SCAN_AHEAD ? SCAN_AHEAD : raPages * 2;
+                else
+                    raPages = 1;
+                raLen = pread(sc->fd, ra, raPages * sc->sectorSize, adr);
+                raAdr = adr;
+                if (raLen < sc->sectorSize) {
+                    raLen = 0;
+                    scanError(sc, bErrIO);
+                    break;
+                }
+            }
+            p = (nodeType *)(ra + (adr - raAdr));
+            lastAdr = adr;
+            for (k = &p->fkey, i = 0; i < p->ct; i++, k += sc->ks) {
+                if (out) {
+                    if (fwrite(k, sc->keySize + sizeof(eAdrType), 1, out) != 1) {
+                        scanError(sc, bErrIO);
+                        break;
+                    }
+                } else if (sc->scan(sc->arg, r, k, eAdr(k + sc->keySize))) {
+                    pthread_mutex_lock(&sc->lock);
+                    sc->stop = true;
+                    pthread_mutex_unlock(&sc->lock);
+                    break;
+                }
+            }
+            if (i < p->ct) break;
+        }
+        if (out && fclose(out)) scanError(sc, bErrIO);
+    }
+    free(name);
+    free(ra);
+    return NULL;
+}
+
+static bErrType scanRanges(bAdrType *first, int *nRanges) {
+    bErrType rc;
+    bufType *buf;
+    bufType *root;
+    int n;
+    int i;
+    int j;
+
+    root = &h->root;
+    n = 0;
+    for (i = 0; i <= ct(root); i++) {
+        if ((rc = readDisk(childN(root, i), &buf)) != 0) return rc;
+        if (leaf(buf)) {
+            first[n++] = buf->adr;
+            continue;
+        }
+        for (j = 0; j <= ct(buf); j++)
+            first[n++] = childN(buf, j);
+    }
+    for (i = 0; i < n; i++) {
+        if ((rc = readDisk(first[i], &buf)) != 0) return rc;
+        while (!leaf(buf)) {
+            if ((rc = readDisk(childLT(fkey(buf)), &buf)) != 0) return rc;
+        }
+        first[i] = buf->adr;
+    }
+    first[n] = 0;
+    *nRanges = n;
+    return bErrOk;
+}
+
+static bErrType scanParallel(int nThreads, scanType *sc) {
+    bErrType rc;
+    pthread_t *tid;
+    bufType *root;
+    int i;
+
+    root = &h->root;
+    if ((sc->first = malloc(((ct(root) + 1) * (h->maxCt + 1) + 1) * sizeof(bAdrType))) == NULL)
+        return error(bErrMemory);
+    if ((tid = malloc(nThreads * sizeof(pthread_t))) == NULL) {
+        free(sc->first);
+        return error(bErrMemory);
+    }
+    if ((rc = scanRanges(sc->first, &sc->nRanges)) != 0
+        || (rc = flushAll()) != 0) {
+        free(tid);
+        free(sc->first);
+        return rc;
+    }
+    if (fflush(h->fp)) {
+        free(tid);
+        free(sc->first);
+        return error(bErrIO);
+    }
+
+    sc->fd = fileno(h->fp);
+    sc->keySize = h->keySize;
+    sc->ks = h->lks;
+    sc->sectorSize = h->sectorSize;
+    sc->nextRange = 0;
+    sc->stop = false;
+    sc->rc = bErrOk;
+    pthread_mutex_init(&sc->lock, NULL);
+    for (i = 0; i < nThreads; i++)
+        if (pthread_create(&tid[i], NULL, scanWorker, sc)) break;
+    if (i == 0) scanWorker(sc);
+    while (i--)
+        pthread_join(tid[i], NULL);
+    pthread_mutex_destroy(&sc->lock);
+
+    free(tid);
+    free(sc->first);
+    return sc->rc;
+}
+
+bErrType bScanParallel(bHandleType handle, int nThreads, bScanType scan, void *arg, int *nRanges) {
+    scanType sc;
+    bufType *root;
+    keyType *k;
+    int i;
+
+    h = handle;
+    root = &h->root;
+    if (leaf(root)) {
+        *nRanges = 1;
+        for (k = fkey(root), i = 0; i < ct(root); i++, k += lks(1))
+            if (scan(arg, 0, key(k), rec(k))) break;
+        return bErrOk;
+    }
+    if (nThreads < 1) nThreads = 1;
+    sc.scan = scan;
+    sc.arg = arg;
+    sc.outName = NULL;
+    sc.nRanges = 0;
+    sc.rc = scanParallel(nThreads, &sc);
+    *nRanges = sc.nRanges;
+    return sc.rc;
+}
+
+bErrType bExport(bHandleType handle, char *fileName, int nThreads, int *nRanges) {
+    scanType sc;
+    bufType *root;
+    keyType *k;
+    FILE *out;
+    char *name;
+    int i;
+
+    h = handle;
+    root = &h->root;
+    if (leaf(root)) {
+        *nRanges = 1;
+        if ((name = malloc(strlen(fileName) + 12)) == NULL) return error(bErrMemory);
+        sprintf(name, "%s.0", fileName);
+        out = fopen(name, "wb");
+        free(name);
+        if (out == NULL) return error(bErrIO);
+        for (k = fkey(root), i = 0; i < ct(root); i++, k += lks(1))
+            if (fwrite(k, h->keySize + sizeof(eAdrType), 1, out) != 1) break;
+        if (fclose(out) || i < ct(root)) return error(bErrIO);
+        return bErrOk;
+    }
+    if (nThreads < 1) nThreads = 1;
+    sc.scan = NULL;
+    sc.arg = NULL;
+    sc.outName = fileName;
+    sc.nRanges = 0;
+    sc.rc = scanParallel(nThreads, &sc);
+    *nRanges = sc.nRanges;
+    return sc.rc;
+}
+
+static bErrType findLeaf(void *key, bufType **b, bAdrType *parent, unsigned int *slot) {
+    bErrType rc;
+    bufType *buf;
+    keyType *mkey;
+    bAdrType *c;
+
+    buf = &h->root;
+    while (!leaf(buf)) {
+        if (search(buf, key, &mkey, MODE_MATCH) < 0)
+            c = &childLT(mkey);
+        else
+            c = &childGE(mkey);
+        *parent = bref(buf);
+        *slot = (char *)c - p(buf);
+        if ((rc = readDisk(*c, &buf)) != 0) return rc;
+    }
+    *b = buf;
+    return bErrOk;
+}
+
+static bAdrType swapAdr(bAdrType adr, bAdrType a, bAdrType b) {
+    if (adr == a) return b;
+    if (adr == b) return a;
+    return adr;
+}
+
+static bErrType relink(bAdrType adr, bAdrType a, bAdrType b) {
+    bErrType rc;
+    bufType *buf;
+
+    if ((rc = readDisk(adr, &buf)) != 0) return rc;
+    prev(buf) = swapAdr(prev(buf), a, b);
+    next(buf) = swapAdr(next(buf), a, b);
+    return writeDisk(buf);
+}
+
+static bErrType setChild(bAdrType parent, unsigned int slot, bAdrType adr) {
+    bErrType rc;
+    bufType *buf;
+
+    if ((rc = readDisk(parent, &buf)) != 0) return rc;
+    bAdr(p(buf) + slot) = adr;
+    return writeDisk(buf);
+}
+
+static bErrType swapLeaf(bAdrType a, bAdrType t, bAdrType parent, unsigned int slot, bool *moved) {
+    bErrType rc;
+    bufType *buf;
+    bufType *root;
+    bufType sa;
+    bufType st;
+    bufType *ba;
+    bufType *bt;
+    bAdrType nb[4];
+    bAdrType tParent;
+    unsigned int tSlot;
+    bool isFree;
+    int i;
+    int j;
+
+    *moved = false;
+    root = &h->root;
+    ba = &sa;
+    bt = &st;
+    ba->p = h->gbuf.p;
+    bt->p = (nodeType *)((char *)h->gbuf.p + h->sectorSize);
+    if (t >= h->nextFreeAdr) return bErrOk;
+    if ((rc = readDisk(t, &buf)) != 0) return rc;
+    memcpy(bt->p, buf->p, h->sectorSize);
+    if (!leaf(bt)) return bErrOk;
+    isFree = ct(bt) == 0;
+    if (isFree) {
+        if (childLT(fkey(bt)) != FREE_MARK) return bErrOk;
+        if (freeHead(root) != t) {
+            if (prev(bt) == 0) return bErrOk;
+            if ((rc = readDisk(prev(bt), &buf)) != 0) return rc;
+            if (!leaf(buf) || ct(buf) || childLT(fkey(buf)) != FREE_MARK || next(buf) != t)
+                return bErrOk;
+        }
+    } else {
+        if ((rc = findLeaf(key(fkey(bt)), &buf, &tParent, &tSlot)) != 0) return rc;
+        if (buf->adr != t) return bErrOk;
+    }
+    if ((rc = readDisk(a, &buf)) != 0) return rc;
+    memcpy(ba->p, buf->p, h->sectorSize);
+
+    nb[0] = prev(ba);
+    nb[1] = next(ba);
+    nb[2] = isFree ? 0 : prev(bt);
+    nb[3] = isFree ? 0 : next(bt);
+    prev(ba) = swapAdr(prev(ba), a, t);
+    next(ba) = swapAdr(next(ba), a, t);
+    if (!isFree) {
+        prev(bt) = swapAdr(prev(bt), a, t);
+        next(bt) = swapAdr(next(bt), a, t);
+    }
+
+    if ((rc = assignBuf(t, &buf)) != 0) return rc;
+    memcpy(buf->p, ba->p, h->sectorSize);
+    if ((rc = writeDisk(buf)) != 0) return rc;
+    if ((rc = assignBuf(a, &buf)) != 0) return rc;
+    memcpy(buf->p, bt->p, h->sectorSize);
+    if ((rc = writeDisk(buf)) != 0) return rc;
+
+    for (i = 0; i < 4; i++) {
+        if (nb[i] == 0 || nb[i] == a || nb[i] == t) continue;
+        for (j = 0; j < i && nb[j] != nb[i]; j++);
+        if (j < i) continue;
+        if ((rc = relink(nb[i], a, t)) != 0) return rc;
+    }
+    if (isFree) {
+        if (freeHead(root) == t) {
+            freeHead(root) = a;
+            if ((rc = writeDisk(root)) != 0) return rc;
+        } else {
+            if ((rc = readDisk(prev(bt), &buf)) != 0) return rc;
+            next(buf) = a;
+            if ((rc = writeDisk(buf)) != 0) return rc;
+        }
+        if (next(bt)) {
+            if ((rc = readDisk(next(bt), &buf)) != 0) return rc;
+            prev(buf) = a;
+            if ((rc = writeDisk(buf)) != 0) return rc;
+        }
+    } else {
+        if ((rc = setChild(tParent, tSlot, a)) != 0) return rc;
+    }
+    if ((rc = setChild(parent, slot, t)) != 0) return rc;
+    if (h->curBuf && h->curBuf != root)
+        h->curAdr = swapAdr(h->curAdr, a, t);
+    *moved = true;
+    return bErrOk;
+}
+
+static bErrType defragTarget(void) {
+    bErrType rc;
+    bufType *buf;
+
+    while (h->defragAdr < h->nextFreeAdr) {
+        if ((rc = readDisk(h->defragAdr, &buf)) != 0) return rc;
+        if (leaf(buf) && (ct(buf) || childLT(fkey(buf)) == FREE_MARK)) break;
+        h->defragAdr += h->sectorSize;
+    }
+    return bErrOk;
+}
+
+bErrType bDefrag(bHandleType handle, int maxLeaves, bDefragType *stat) {
+    bErrType rc;
+    bufType *buf;
+    bAdrType parent;
+    bAdrType adr;
+    bAdrType nextAdr;
+    unsigned int slot;
+    bool moved;
+    int n;
+
+    h = handle;
+    buf = &h->root;
+    if (leaf(buf)) {
+        memset(stat, 0, sizeof(bDefragType));
+        stat->done = true;
+        return bErrOk;
+    }
+    if (h->defragKey == NULL) {
+        if ((h->defragKey = malloc(h->keySize)) == NULL) return error(bErrMemory);
+        while (!leaf(buf)) {
+            if ((rc = readDisk(childLT(fkey(buf)), &buf)) != 0) return rc;
+        }
+        memcpy(h->defragKey, key(fkey(buf)), h->keySize);
+        h->defragAdr = 3 * h->sectorSize;
+        memset(stat, 0, sizeof(bDefragType));
+    }
+
+    for (n = 0; n < maxLeaves; n++) {
+        if ((rc = findLeaf(h->defragKey, &buf, &parent, &slot)) != 0) return rc;
+        stat->leaves++;
+        adr = buf->adr;
+        nextAdr = next(buf);
+        if ((rc = defragTarget()) != 0) return rc;
+        if (adr == h->defragAdr) {
+            stat->sequential++;
+            h->defragAdr += h->sectorSize;
+        } else if (adr > h->defragAdr && h->defragAdr < h->nextFreeAdr) {
+            if ((rc = swapLeaf(adr, h->defragAdr, parent, slot, &moved)) != 0) return rc;
+            if (moved) {
+                stat->moved++;
+                if ((rc = readDisk(h->defragAdr, &buf)) != 0) return rc;
+                nextAdr = next(buf);
+            }
+            h->defragAdr += h->sectorSize;
+        }
+        if (!nextAdr) {
+            free(h->defragKey);
+            h->defragKey = NULL;
+            stat->done = true;
+            return bErrOk;
+        }
+        if ((rc = readDisk(nextAdr, &buf)) != 0) return rc;
+        memcpy(h->defragKey, key(fkey(buf)), h->keySize);
+    }
+    stat->done = false;
+    return bErrOk;
+}
+
+static bErrType compactValue(FILE *fp, bAdrType *head, char *page, bAdrType *innerAdr) {
+    bErrType rc;
+    bufType *buf;
+    bufType tbuf;
+    bAdrType adr;
+
+    adr = *head;
+    *head = *innerAdr;
+    tbuf.p = (nodeType *)page;
+    while (adr) {
+        if ((rc = readDisk(adr, &buf)) != 0) return rc;
+        memcpy(tbuf.p, buf->p, h->sectorSize);
+        buf = &tbuf;
+        adr = next(buf);
+        *innerAdr += h->sectorSize;
+        if (adr) next(buf) = *innerAdr;
+        if (fseek(fp, *innerAdr - h->sectorSize, SEEK_SET)) return error(bErrIO);
+        if (fwrite(buf->p, h->sectorSize, 1, fp) != 1) return error(bErrIO);
+        nDiskWrites++;
+    }
+    return bErrOk;
+}
+
+static bErrType compactNode(FILE *fp, bAdrType ref, char *page, bAdrType *leafAdr, bAdrType leafEnd,
+                            bAdrType *innerAdr, bAdrType *adr) {
+    bErrType rc;
+    bufType *buf;
+    bufType tbuf;
+    bAdrType *c;
+    bAdrType cadr;
+    keyType *k;
+    int i;
+
+    if ((rc = readDisk(ref, &buf)) != 0) return rc;
+    tbuf.p = (nodeType *)page;
+    memcpy(tbuf.p, buf->p, h->sectorSize);
+    buf = &tbuf;
+
+    if (leaf(buf)) {
+        *adr = *leafAdr;
+        *leafAdr += h->sectorSize;
+        prev(buf) = *adr == 3 * h->sectorSize ? 0 : *adr - h->sectorSize;
+        next(buf) = *leafAdr == leafEnd ? 0 : *leafAdr;
+        for (i = 0; h->valueSize && i < ct(buf); i++) {
+            k = fkey(buf) + lks(i);
+            if (valLen(k) > h->valueSize)
+                if ((rc = compactValue(fp, &bAdr(valData(k)), page + h->sectorSize, innerAdr)) != 0) return rc;
+        }
+    } else {
+        for (i = 0; i <= ct(buf); i++) {
+            c = i ? &childGE(fkey(buf) + ks(i - 1)) : &childLT(fkey(buf));
+            if ((rc = compactNode(fp, *c, page + h->sectorSize, leafAdr, leafEnd,
+                                  innerAdr, &cadr)) != 0) return rc;
+            *c = cadr;
+        }
+        *adr = *innerAdr;
+        *innerAdr += h->sectorSize;
+    }
+    if (fseek(fp, *adr, SEEK_SET)) return error(bErrIO);
+    if (fwrite(buf->p, h->sectorSize, 1, fp) != 1) return error(bErrIO);
+    nDiskWrites++;
+    return bErrOk;
+}
+
+static bErrType countLeaves(bAdrType ref, int depth, long *n) {
+    bErrType rc;
+    bufType *buf;
+    bAdrType *c;
+    int ct;
+    int i;
+
+    if ((rc = readDisk(ref, &buf)) != 0) return rc;
+    ct = ct(buf);
+    if (depth == 1) {
+        *n += ct + 1;
+        return bErrOk;
+    }
+    if ((c = malloc((ct + 1) * sizeof(bAdrType))) == NULL) return error(bErrMemory);
+    for (i = 0; i <= ct; i++)
+        c[i] = childN(buf, i);
+    for (i = 0; i <= ct; i++)
+        if ((rc = countLeaves(c[i], depth - 1, n)) != 0) break;
+    free(c);
+    return rc;
+}
+
+bErrType bCompact(bHandleType handle, char *fileName) {
+    bErrType rc;
+    bufType *buf;
+    bufType *root;
+    bufType tbuf;
+    bAdrType *c;
+    bAdrType cadr;
+    bAdrType leafAdr;
+    bAdrType leafEnd;
+    bAdrType innerAdr;
+    keyType *k;
+    char *page;
+    FILE *fp;
+    long nLeaves;
+    int depth;
+    int i;
+
+    h = handle;
+    root = &h->root;
+    depth = 0;
+    buf = root;
+    while (!leaf(buf)) {
+        if ((rc = readDisk(childLT(fkey(buf)), &buf)) != 0) return rc;
+        depth++;
+    }
+    nLeaves = 0;
+    if (depth)
+        if ((rc = countLeaves(0, depth, &nLeaves)) != 0) return rc;
+
+    if ((page = malloc((3 + MAX_HEIGHT) * h->sectorSize)) == NULL)
+        return error(bErrMemory);
+    if ((fp = fopen(fileName, "wb")) == NULL) {
+        free(page);
+        return bErrFileNotOpen;
+    }
+    tbuf.p = (nodeType *)page;
+    memcpy(tbuf.p, root->p, 3 * h->sectorSize);
+    buf = &tbuf;
+    freeHead(buf) = 0;
+    modStamp(buf) = newStamp(modStamp(buf));
+    leafAdr = 3 * h->sectorSize;
+    leafEnd = leafAdr + nLeaves * h->sectorSize;
+    innerAdr = leafEnd;
+    rc = bErrOk;
+    if (!leaf(buf)) {
+        for (i = 0; i <= ct(buf); i++) {
+            c = i ? &childGE(fkey(buf) + ks(i - 1)) : &childLT(fkey(buf));
+            if ((rc = compactNode(fp, *c, page + 3 * h->sectorSize, &leafAdr, leafEnd,
+                                  &innerAdr, &cadr)) != 0) break;
+            *c = cadr;
+        }
+    } else {
+        for (i = 0; h->valueSize && i < ct(buf); i++) {
+            k = fkey(buf) + lks(i);
+            if (valLen(k) > h->valueSize)
+                if ((rc = compactValue(fp, &bAdr(valData(k)), page + 3 * h->sectorSize, &innerAdr)) != 0) break;
+        }
+    }
+    if (rc == bErrOk) {
+        if (fseek(fp, 0, SEEK_SET) || fwrite(buf->p, 3 * h->sectorSize, 1, fp) != 1)
+            rc = error(bErrIO);
+        nDiskWrites++;
+    }
+    if (fclose(fp) && rc == bErrOk) rc = error(bErrIO);
+    free(page);
+    return rc;
+}
+
+static int childIdx(bufType *buf, void *key) {
+    keyType *mkey;
+    int cc;
+    int i;
+
+    cc = search(buf, key, &mkey, MODE_MATCH);
+    i = (mkey - fkey(buf)) / nks(buf, 1);
+    return cc < 0 ? i : i + 1;
+}
+
+static bErrType freeTree(bAdrType ref, int depth, bCntType *keys) {
+    bErrType rc;
+    bufType *buf;
+    bAdrType *c;
+    bAdrType adr;
+    int ct;
+    int i;
+
+    if (depth == 0) {
+        if (h->valueSize) {
+            if ((rc = readDisk(ref, &buf)) != 0) return rc;
+            if (!h->counted) *keys += ct(buf);
+            if ((rc = valueFreeRange(ref, 0, ct(buf))) != 0) return rc;
+        } else if (!h->counted) {
+            *keys += h->lMaxCt / 2;
+        }
+        return freePage(ref);
+    }
+    if ((rc = readDisk(ref, &buf)) != 0) return rc;
+    ct = ct(buf);
+    if ((c = malloc((ct + 1) * sizeof(bAdrType))) == NULL) return error(bErrMemory);
+    for (i = 0; i <= ct; i++)
+        c[i] = childN(buf, i);
+    adr = buf->adr;
+    if (buf->pinned) unpin(buf);
+    rc = freePage(adr);
+    nNodesDel++;
+    for (i = 0; rc == bErrOk && i <= ct; i++)
+        rc = freeTree(c[i], depth - 1, keys);
+    free(c);
+    return rc;
+}
+
+static bErrType cutChildren(bufType *buf, int a, int b, int depth, bCntType *keys) {
+    bErrType rc;
+    bAdrType *c;
+    int n;
+    int i;
+
+    if ((n = b - a) <= 0) return bErrOk;
+    if ((c = malloc(n * sizeof(bAdrType))) == NULL) return error(bErrMemory);
+    for (i = 0; i < n; i++) {
+        c[i] = childN(buf, a + i);
+        if (h->counted) *keys += cntN(buf, a + i);
+    }
+    if (a) {
+        memmove(fkey(buf) + ks(a - 1), fkey(buf) + ks(b - 1), ks(ct(buf) - b + 1));
+    } else {
+        childLT(fkey(buf)) = childGE(fkey(buf) + ks(b - 1));
+        if (h->counted) cntLT(fkey(buf)) = cntGE(fkey(buf) + ks(b - 1));
+        memmove(fkey(buf), fkey(buf) + ks(b), ks(ct(buf) - b));
+    }
+    ct(buf) -= n;
+    rc = writeDisk(buf);
+    for (i = 0; rc == bErrOk && i < n; i++)
+        rc = freeTree(c[i], depth - 1, keys);
+    free(c);
+    return rc;
+}
+
+static bErrType cutRange(bAdrType ref, int depth, void *lo, void *hi, bCntType *keys) {
+    bErrType rc;
+    bufType *buf;
+    bufType *cbuf;
+    keyType *mkey;
+    bAdrType cref;
+    bCntType cnt;
+    unsigned int off;
+    int iLo;
+    int iHi;
+    int cc;
+    int n;
+    int i;
+
+    if ((rc = readDisk(ref, &buf)) != 0) return rc;
+    if (depth == 0) {
+        iLo = 0;
+        if (lo) {
+            cc = search(buf, lo, &mkey, MODE_MATCH);
+            iLo = (mkey - fkey(buf)) / h->lks + (cc > 0);
+        }
+        iHi = hi ? childIdx(buf, hi) : ct(buf);
+        if ((n = iHi - iLo) <= 0) return bErrOk;
+        if (h->valueSize) {
+            if ((rc = valueFreeRange(ref, iLo, iHi)) != 0) return rc;
+            if ((rc = readDisk(ref, &buf)) != 0) return rc;
+        }
+        memmove(fkey(buf) + lks(iLo), fkey(buf) + lks(iHi), lks(ct(buf) - iHi));
+        ct(buf) -= n;
+        *keys += n;
+        return writeDisk(buf);
+    }
+
+    iLo = lo ? childIdx(buf, lo) : 0;
+    iHi = hi ? childIdx(buf, hi) : ct(buf);
+    if (!lo) {
+        if ((rc = cutChildren(buf, 0, iHi, depth, keys)) != 0) return rc;
+        iLo = iHi = 0;
+    } else if (!hi) {
+        if ((rc = cutChildren(buf, iLo + 1, iHi + 1, depth, keys)) != 0) return rc;
+        iHi = iLo;
+    } else if (iHi > iLo) {
+        if ((rc = cutChildren(buf, iLo + 1, iHi, depth, keys)) != 0) return rc;
+        iHi = iLo + 1;
+    }
+
+    for (i = iLo; i <= iHi; i++) {
+        if ((rc = readDisk(ref, &buf)) != 0) return rc;
+        cref = childN(buf, i);
+        off = (char *)&cntLT(fkey(buf) + ks(i)) - p(buf);
+        if (iLo == iHi)
+            rc = cutRange(cref, depth - 1, lo, hi, keys);
+        else if (i == iLo)
+            rc = cutRange(cref, depth - 1, lo, NULL, keys);
+        else
+            rc = cutRange(cref, depth - 1, NULL, hi, keys);
+        if (rc != 0) return rc;
+        if (h->counted) {
+            if ((rc = readDisk(cref, &cbuf)) != 0) return rc;
+            cnt = subCount(cbuf);
+            if ((rc = readDisk(ref, &buf)) != 0) return rc;
+            bCnt(p(buf) + off) = cnt;
+            if ((rc = writeDisk(buf)) != 0) return rc;
+        }
+    }
+    return bErrOk;
+}
+
+static bErrType rootFix(void) {
+    bErrType rc;
+    bufType *root;
+    bufType *gbuf;
+    bufType *tmp[2];
+    keyType *gkey;
+    int n;
+    int i;
+
+    root = &h->root;
+    gbuf = &h->gbuf;
+    while (!leaf(root) && ct(root) < 2) {
+        n = ct(root) + 1;
+        for (i = 0; i < n; i++)
+            if ((rc = readDisk(childN(root, i), &tmp[i])) != 0) return rc;
+        gkey = fkey(gbuf);
+        childLT(gkey) = childLT(fkey(tmp[0]));
+        if (h->counted && !leaf(tmp[0]))
+            cntLT(gkey) = cntLT(fkey(tmp[0]));
+        ct(gbuf) = 0;
+        for (i = 0; i < n; i++) {
+            if (i && !leaf(tmp[i])) {
+                memcpy(gkey, fkey(root), ks(1));
+                childGE(gkey) = childLT(fkey(tmp[i]));
+                if (h->counted) cntGE(gkey) = cntLT(fkey(tmp[i]));
+                ct(gbuf)++;
+                gkey += ks(1);
+            }
+            memcpy(gkey, fkey(tmp[i]), nks(tmp[i], ct(tmp[i])));
+            gkey += nks(tmp[i], ct(tmp[i]));
+            ct(gbuf) += ct(tmp[i]);
+            leaf(gbuf) = leaf(tmp[i]);
+        }
+        scatterRoot();
+        if ((rc = dropNodes(tmp, n)) != 0) return rc;
+        nNodesDel += n;
+    }
+    return writeDisk(root);
+}
+
+static bErrType repairPath(void *key) {
+    bErrType rc;
+    bufType *root;
+    bufType *gbuf;
+    bufType *buf;
+    bufType *cbuf;
+    bufType *tmp[4];
+    keyType *mkey;
+    int cc;
+
+    root = &h->root;
+    gbuf = &h->gbuf;
+    if ((rc = rootFix()) != 0) return rc;
+    buf = root;
+    while (!leaf(buf)) {
+        cc = search(buf, key, &mkey, MODE_MATCH);
+        if ((rc = readDisk(cc < 0 ? childLT(mkey) : childGE(mkey), &cbuf)) != 0) return rc;
+        if (ct(cbuf) <= nMax(cbuf)/2) {
+            if ((rc = gather(buf, &mkey, tmp)) != 0) return rc;
+            if (buf == root && ct(root) == 2 && ct(gbuf) < (3*(3*nMax(gbuf)))/4) {
+                scatterRoot();
+                if ((rc = dropNodes(tmp, 3)) != 0) return rc;
+                nNodesDel += 3;
+                continue;
+            }
+            if ((rc = scatter(buf, mkey, 3, tmp)) != 0) return rc;
+            if (buf == root && ct(root) < 2) {
+                if ((rc = rootFix()) != 0) return rc;
+                continue;
+            }
+            cc = search(buf, key, &mkey, MODE_MATCH);
+            if ((rc = readDisk(cc < 0 ? childLT(mkey) : childGE(mkey), &cbuf)) != 0) return rc;
+        }
+        buf = cbuf;
+    }
+    return bErrOk;
+}
+
+bErrType bDeleteRange(bHandleType handle, void *lo, void *hi) {
+    bErrType rc;
+    bufType *buf;
+    bAdrType lAdr;
+    bAdrType rAdr;
+    bAdrType parent;
+    unsigned int slot;
+    bCntType keys;
+    int depth;
+
+    h = handle;
+    if (h->comp(lo, hi) > 0) return bErrOk;
+    h->curBuf = NULL;
+
+    depth = 0;
+    buf = &h->root;
+    while (!leaf(buf)) {
+        if ((rc = readDisk(childLT(fkey(buf)), &buf)) != 0) return rc;
+        depth++;
+    }
+    lAdr = rAdr = 0;
+    if (depth) {
+        if ((rc = findLeaf(lo, &buf, &parent, &slot)) != 0) return rc;
+        lAdr = buf->adr;
+        if ((rc = findLeaf(hi, &buf, &parent, &slot)) != 0) return rc;
+        rAdr = buf->adr;
+    }
+
+    keys = 0;
+    if ((rc = cutRange(0, depth, lo, hi, &keys)) != 0) return rc;
+    if (lAdr != rAdr) {
+        if ((rc = readDisk(lAdr, &buf)) != 0) return rc;
+        next(buf) = rAdr;
+        if ((rc = writeDisk(buf)) != 0) return rc;
+        if ((rc = readDisk(rAdr, &buf)) != 0) return rc;
+        prev(buf) = lAdr;
+        if ((rc = writeDisk(buf)) != 0) return rc;
+    }
+    if (depth) {
+        if ((rc = repairPath(lo)) != 0) return rc;
+        if ((rc = repairPath(hi)) != 0) return rc;
+    }
+
+    nKeysDel += keys;
+    if (h->filter && keys && 2 * (h->filter->nDel += keys) > h->filter->nIns)
+        if ((rc = filterBuild()) != 0) return rc;
+    return bErrOk;
+}
+
+static bErrType asyncRun(asyncType *a, bufType *buf) {
+    bErrType rc;
+
+    h->noWait = true;
+    if (a->step)
+        rc = bFindNextKey(h, a->key, &a->rec);
+    else if (buf == &h->root && h->filter && !filterHas(a->key))
+        rc = bErrKeyNotFound;
+    else
+        rc = findFrom(buf, a->key, &a->rec);
+    h->noWait = false;
+    return rc;
+}
+
+static void asyncPost(asyncType *a) {
+    ioType *io;
+
+    io = h->io;
+    pthread_mutex_lock(&io->lock);
+    a->next = NULL;
+    if (a->ready) {
+        *io->doneTail = a;
+        io->doneTail = &a->next;
+        if (write(io->wake[1], "", 1) < 0) {}
+    } else {
+        *io->todoTail = a;
+        io->todoTail = &a->next;
+        pthread_cond_signal(&io->cond);
+    }
+    pthread_mutex_unlock(&io->lock);
+}
+
+static bool asyncStep(asyncType *a, bufType *buf) {
+    bErrType rc;
+
+    rc = asyncRun(a, buf);
+    if (rc == ERR_PENDING) {
+        if (fflush(h->fp) == 0) {
+            a->adr = h->missAdr;
+            a->writeSeq = h->writeSeq;
+            asyncPost(a);
+            return true;
+        }
+        rc = error(bErrIO);
+    }
+    a->rc = rc;
+    a->ready = true;
+    return false;
+}
+
+static bErrType asyncSubmit(bool step, void *key, bDoneType done, void *arg) {
+    asyncType *a;
+
+    if (h->io == NULL) return bErrNotAsync;
+    if ((a = malloc(sizeof(asyncType) + h->keySize + h->sectorSize)) == NULL)
+        return error(bErrMemory);
+    a->step = step;
+    a->ready = false;
+    a->done = done;
+    a->arg = arg;
+    a->key = (char *)(a + 1);
+    a->page = a->key + h->keySize;
+    if (key) memcpy(a->key, key, h->keySize);
+    if (!asyncStep(a, &h->root)) asyncPost(a);
+    return bErrOk;
+}
+
+bErrType bFindKeyAsync(bHandleType handle, void *key, bDoneType done, void *arg) {
+    h = handle;
+    return asyncSubmit(false, key, done, arg);
+}
+
+bErrType bFindNextKeyAsync(bHandleType handle, bDoneType done, void *arg) {
+    h = handle;
+    return asyncSubmit(true, NULL, done, arg);
+}
+
+bErrType bPoll(bHandleType handle, int *nDone) {
+    bErrType rc;
+    ioType *io;
+    asyncType *a;
+    asyncType *list;
+    bufType *buf;
+    char drain[64];
+
+    h = handle;
+    *nDone = 0;
+    if ((io = h->io) == NULL) return bErrNotAsync;
+    while (read(io->wake[0], drain, sizeof(drain)) > 0);
+
+    pthread_mutex_lock(&io->lock);
+    list = io->done;
+    io->done = NULL;
+    io->doneTail = &io->done;
+    pthread_mutex_unlock(&io->lock);
+
+    while ((a = list) != NULL) {
+        list = a->next;
+        if (!a->ready) {
+            if (a->rc != bErrOk) {
+                a->ready = true;
+            } else {
+                rc = bErrOk;
+                buf = &h->root;
+                if (a->writeSeq == h->writeSeq) {
+                    if ((rc = assignBuf(a->adr, &buf)) == 0 && !buf->valid) {
+                        memcpy(buf->p, a->page, h->sectorSize);
+                        buf->valid = true;
+                        buf->modified = false;
+                        nDiskReads++;
+                    }
+                }
+                if (rc != 0) {
+                    a->rc = rc;
+                    a->ready = true;
+                } else if (asyncStep(a, buf)) {
+                    continue;
+                }
+            }
+        }
+        a->done(a->arg, a->rc, a->rc ? NULL : a->key, a->rec);
+        free(a);
+        (*nDone)++;
+        h = handle;
+    }
+    return bErrOk;
+}
+
+int bPollFd(bHandleType handle) {
+    h = handle;
+    return h->io ? h->io->wake[0] : -1;
+}
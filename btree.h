@@ -3,12 +3,15 @@
 
 typedef long eAdrType;
 typedef long bAdrType;
+typedef long bCntType;
 
 #define CC_EQ           0
 #define CC_GT           1
 #define CC_LT          -1
 
 typedef int (*bCompType)(const void *key1, const void *key2);
+typedef unsigned long (*bHashType)(const void *key);
+typedef int (*bScanType)(void *arg, int range, const void *key, eAdrType rec);
 
 typedef enum {false, true} bool;
 typedef enum {
@@ -20,34 +23,65 @@ typedef enum {
     bErrFileExists,
     bErrIO,
     bErrMemory,
+    bErrNotCounted,
+    bErrPoolInUse,
+    bErrNotAsync,
+    bErrNoValues,
 } bErrType;
 
 typedef void *bHandleType;
+typedef void (*bDoneType)(void *arg, bErrType rc, const void *key, eAdrType rec);
+
+typedef struct {
+    long leaves;
+    long sequential;
+    long moved;
+    bool done;
+} bDefragType;
 
 typedef struct {
     char *iName;
     int keySize;
     int sectorSize;
     bCompType comp;
+    bool counted;
+    int filterSize;
+    bHashType hash;
+    bool pinned;
+    int ioThreads;
+    int valueSize;
 } bOpenType;
 
 #define bAdr(p) *(bAdrType *)(p)
 #define eAdr(p) *(eAdrType *)(p)
+#define bCnt(p) *(bCntType *)(p)
 
 #define childLT(k) bAdr((char *)k - sizeof(bAdrType))
 #define key(k) (k)
 #define rec(k) eAdr((char *)(k) + h->keySize)
-#define childGE(k) bAdr((char *)(k) + h->keySize + sizeof(eAdrType))
+#define val(k) ((char *)(k) + h->ks)
+#define valLen(k) *(long *)val(k)
+#define valData(k) (val(k) + sizeof(long))
+#define childGE(k) bAdr((char *)(k) + h->ks - sizeof(bAdrType))
+#define cntLT(k) bCnt((char *)(k) - sizeof(bAdrType) - sizeof(bCntType))
+#define cntGE(k) bCnt((char *)(k) + h->ks - sizeof(bAdrType) - sizeof(bCntType))
 
 #define leaf(b) b->p->leaf
 #define ct(b) b->p->ct
 #define next(b) b->p->next
 #define prev(b) b->p->prev
 #define fkey(b) &b->p->fkey
-#define lkey(b) (fkey(b) + ks((ct(b) - 1)))
+#define lkey(b) (fkey(b) + nks(b, ct(b) - 1))
 #define p(b) (char *)(b->p)
+#define childN(b, i) ((i) ? childGE(fkey(b) + ks((i) - 1)) : childLT(fkey(b)))
+#define cntN(b, i) ((i) ? cntGE(fkey(b) + ks((i) - 1)) : cntLT(fkey(b)))
+#define freeHead(b) bAdr(p(b) + 3 * h->sectorSize - sizeof(bAdrType))
+#define modStamp(b) bAdr(p(b) + 3 * h->sectorSize - 2 * sizeof(bAdrType))
 
 #define ks(ct) ((ct) * h->ks)
+#define lks(ct) ((ct) * h->lks)
+#define nks(b, ct) (leaf(b) ? lks(ct) : ks(ct))
+#define nMax(b) (leaf(b) ? h->lMaxCt : h->maxCt)
 
 typedef char keyType;
 
@@ -60,6 +94,15 @@ typedef struct {
     keyType fkey;
 } nodeType;
 
+typedef struct {
+    unsigned char *bits;
+    long size;
+    long nIns;
+    long nDel;
+    bHashType hash;
+    char *name;
+} filterType;
+
 typedef struct bufTypeTag {
     struct bufTypeTag *next;
     struct bufTypeTag *prev;
@@ -67,6 +110,12 @@ typedef struct bufTypeTag {
     nodeType *p;
     bool valid;
     bool modified;
+    bool pinned;
+    struct hNodeTag *owner;
+    struct bufTypeTag *hnext;
+    unsigned long used;
+    int hits;
+    int size;
 } bufType;
 
 typedef struct hNodeTag {
@@ -83,19 +132,65 @@ typedef struct hNodeTag {
     bufType gbuf;
     bufType *curBuf;
     keyType *curKey;
+    bAdrType curAdr;
     unsigned int maxCt;
+    unsigned int lMaxCt;
     int ks;
+    int lks;
+    bool counted;
     bAdrType nextFreeAdr;
+    filterType *filter;
+    bufType *pinList;
+    keyType *defragKey;
+    bAdrType defragAdr;
+    bool pooled;
+    long poolFrames;
+    struct ioTag *io;
+    bool noWait;
+    bAdrType missAdr;
+    unsigned long writeSeq;
+    bool stamped;
+    int valueSize;
+    char *valSlot;
 } hNode;
 
+typedef struct {
+    bufType **frame;
+    long nFrames;
+    long maxFrames;
+    long hand;
+    bufType **hash;
+    long nHash;
+    long bytes;
+    long maxBytes;
+    unsigned long tick;
+    int nHandles;
+} poolType;
+
 bErrType bOpen(bOpenType info, bHandleType *handle);
 bErrType bClose(bHandleType handle);
 bErrType bInsertKey(bHandleType handle, void *key, eAdrType rec);
 bErrType bDeleteKey(bHandleType handle, void *key);
+bErrType bDeleteRange(bHandleType handle, void *lo, void *hi);
+bErrType bInsertValue(bHandleType handle, void *key, eAdrType rec, const void *value, long len);
 bErrType bFindKey(bHandleType handle, void *key, eAdrType *rec);
 bErrType bFindFirstKey(bHandleType handle, void *key, eAdrType *rec);
 bErrType bFindLastKey(bHandleType handle, void *key, eAdrType *rec);
 bErrType bFindNextKey(bHandleType handle, void *key, eAdrType *rec);
 bErrType bFindPrevKey(bHandleType handle, void *key, eAdrType *rec);
+bErrType bCountRange(bHandleType handle, void *lo, void *hi, bCntType *count);
+bErrType bCurValue(bHandleType handle, void *value, long size, long *len);
+bErrType bSeekRank(bHandleType handle, bCntType rank, void *key, eAdrType *rec);
+bErrType bScanParallel(bHandleType handle, int nThreads, bScanType scan, void *arg, int *nRanges);
+bErrType bExport(bHandleType handle, char *fileName, int nThreads, int *nRanges);
+bErrType bDefrag(bHandleType handle, int maxLeaves, bDefragType *stat);
+bErrType bCompact(bHandleType handle, char *fileName);
+bErrType bPoolInit(long maxBytes);
+bErrType bPoolFree(void);
+bErrType bPoolStat(bHandleType handle, long *frames, long *bytes);
+bErrType bFindKeyAsync(bHandleType handle, void *key, bDoneType done, void *arg);
+bErrType bFindNextKeyAsync(bHandleType handle, bDoneType done, void *arg);
+bErrType bPoll(bHandleType handle, int *nDone);
+int bPollFd(bHandleType handle);
 
 #endif